@@ -6,12 +6,21 @@
  *     single file
  *     header only
  *     high performance K Nearest Neighbor and ball searches
- *     dynamic insertions
+ *     dynamic insertions and removals
  *     simple API
  *     depends only on the STL
  *     templatable on your custom data type to store in the leaves. No need to keep a separate data structure!
  *     templatable on double, float etc
  *     templatable on L1, SquaredL2 or custom distance functor
+ *     templatable on median, sliding midpoint, surface area or custom split policy
+ *     templatable on point major or dimension major coordinate layout in the buckets
+ *     templatable on the integer type used for node indices and point counts, to make the nodes smaller
+ *     can be frozen into a read-only tree laid out for searching
+ *     templatable on the allocator for the memory of the tree
+ *     templatable on the precision of the node bounds, to fit more of the tree in the cache
+ *     templatable on how the nodes are stored, in chunks which are never copied as the tree grows
+ *     large payloads can be kept out of the tree, which then only stores an index to each
+ *     can store no payload at all, returning the index each point was added with instead
  *     templated on number of dimensions for efficient inlining
  *
  * -------------------------------------------------------------------
@@ -78,7 +87,22 @@
  * Tuning tips:
  *
  * If you need to add a lot of points before doing any queries, set the optional `autosplit` parameter to false,
- * then call splitOutstanding(). This will reduce temporaries and result in a better balanced tree.
+ * then call splitOutstanding(). This will reduce temporaries and result in a better balanced tree. For large trees,
+ * splitOutstanding(threads) does the same work on several threads and gives identical query results. If all the points
+ * are available at once, constructing the tree from them with build() is faster again, and gives the same tree.
+ *
+ * If points have to be added with autosplit while querying, call setMaxImbalance(0.6) so that subtrees which become
+ * unbalanced are rebuilt. This keeps queries almost as fast as on a tree built all at once, even if points arrive in
+ * order.
+ *
+ * If points are added much more often than the tree is queried, a KDForest is cheaper to add to. It keeps a
+ * few perfectly balanced trees and rebuilds each point only O(log n) times, at the cost of searching every tree.
+ *
+ * If the tree won't change for a while after it is built, freeze() it. The FrozenKDTree has the same search API, with
+ * the nodes in depth first order and no free slots in the buckets, so it is smaller and faster to search.
+ *
+ * If only recently added points are of interest, a KDWindow drops the points older than a time window a whole
+ * epoch at a time, so old points stop costing memory and query time without rebuilding the tree.
  *
  * Set the bucket size to be at least twice the K in a typical KNN query. If you have more dimensions, it is better to
  * have a larger bucket size. 32 is a good starting point. If possible use powers of 2 for the bucket size.
@@ -97,476 +121,3116 @@
  * random. The tree will adapt to any locally reduced dimensionality, which is found in most real world data.
  *
  * Hybrid ball/KNN searches are faster than either type on its own, because subtrees can be more aggresively eliminated.
+ *
+ * Payloads are stored apart from the coordinates, so large payloads don't slow down scanning the buckets. With
+ * DimensionMajorLayout the coordinates in each bucket are stored one dimension after another, so the compiler can
+ * vectorize the distance calculations for L1, SquaredL2 or custom distances providing coordinateDistance().
+ * The free slots of the buckets hold default constructed payloads, so Payload must be default constructible.
+ *
+ * Buckets are scanned in blocks of points, picking out the points which could be in the results without branches. With
+ * GCC and Clang on x86 the scan is also compiled for AVX2, which is used if the CPU has it, so a program built for any
+ * x86 CPU still gets the wider vectors. With GCC, build with -O3 for these loops to be vectorized.
+ *
+ * With many dimensions, most points in a bucket are already too far after summing a few of them. L1, SquaredL2 and
+ * custom distances declaring `static const bool monotonic = true;` stop summing the distance to such points early.
+ *
+ * If payloads are large, an IndirectKDTree keeps them in a separate array and only stores their indices in the tree,
+ * so they are never copied while splitting or searching.
+ *
+ * If the points already live in an array of your own, use void as the Payload. The tree then stores the index of each
+ * point in the order they were added or built, and results carry that index as their payload, so there is no payload
+ * to copy in and out of the tree.
+ *
+ * With double coordinates, float is usually precise enough for the bounds of the nodes, set with the BoundsScalar
+ * template parameter. The bounds are rounded outwards, so search results are exact, and the nodes get much smaller.
+ *
+ * With ChunkedNodes for the NodeStorage template parameter, the nodes are kept in fixed size chunks which never move,
+ * instead of one array which is copied, and briefly held twice, whenever it grows. This doesn't bound the time to add
+ * a point. The points are still kept in one array, which is grown and repacked now and then, and the slowest
+ * addPoint() takes time proportional to the number of points either way.
+ *
+ * If the tree will never hold more than a billion points, use std::uint32_t for the Index template parameter. The nodes
+ * and search stacks get smaller, so more of the tree fits in the cache. Index also numbers the slots the points are
+ * stored in, which with their free and unused slots can be about 3 times as many as the points, and more after removing
+ * points until compact() is called. Indices which don't fit are not checked for, and corrupt the tree.
+ *
+ * The default MedianSplit policy gives a balanced tree, which is best for uniformly spread data. For clustered data,
+ * such as scans of surfaces, SlidingMidpointSplit or SurfaceAreaSplit cut through empty space instead and need fewer
+ * nodes visited per query. Searcher::visitedNodes() can be used to compare them on your own data.
+ *
+ * If many trees are built and thrown away, give them an Allocator which allocates from an arena, so a whole tree is
+ * freed at once. All the memory held by a tree comes from its allocator, which must be thread safe if
+ * splitOutstanding(threads) is used. Search results and temporaries use the default allocator, so searches don't grow
+ * the arena.
+ *
+ * removePoint() leaves the bounds of the nodes as they were unless asked to shrink them, and keeps the slots of removed
+ * points for reuse. After removing a lot of points, call compact() to reclaim the memory and tighten the bounds again.
+ *
+ * memoryUsage() reports how much memory the tree has allocated, and how much of it holds nodes and points. Buckets keep
+ * free slots for points added later, so once a tree is built and won't grow, shrinkToFit() gives back the spare memory.
  */
 
 #include <algorithm>
 #include <array>
 #include <cmath>
+#include <cstdint>
+#include <deque>
+#include <iterator>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <set>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
+// Bucket scans are also compiled for AVX2 and picked at runtime if the CPU has it, with GCC and Clang on x86. Define
+// KDTREE_NO_RUNTIME_DISPATCH to only use the instruction set the code is compiled for.
+#if !defined(KDTREE_NO_RUNTIME_DISPATCH) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KDTREE_RUNTIME_DISPATCH
+#endif
+
 namespace jk
 {
 namespace tree
 {
+    // Distances which are a sum over the dimensions can provide coordinateDistance(), the term for one dimension, so
+    // that buckets stored with DimensionMajorLayout are scanned a dimension at a time. It must be summed in order of
+    // dimension, starting from 0, to give exactly the same result as distance().
+    // If none of the terms can be negative, a distance can also declare `static const bool monotonic = true;`, so that
+    // summing the distance to a point in a bucket stops once it is already too far for the results.
     struct L1
     {
+        static const bool monotonic = true;
+
         template <std::size_t Dimensions, typename Scalar>
         static Scalar distance(const std::array<Scalar, Dimensions>& location1,
                                const std::array<Scalar, Dimensions>& location2)
         {
-            auto abs = [](Scalar v) { return v >= 0 ? v : -v; };
             Scalar dist = 0;
             for (std::size_t i = 0; i < Dimensions; i++)
             {
-                dist += abs(location1[i] - location2[i]);
+                dist += coordinateDistance(location1[i], location2[i]);
             }
             return dist;
         }
+
+        template <typename Scalar>
+        static Scalar coordinateDistance(Scalar coordinate1, Scalar coordinate2)
+        {
+            Scalar v = coordinate1 - coordinate2;
+            return v >= 0 ? v : -v;
+        }
     };
 
     struct SquaredL2
     {
+        static const bool monotonic = true;
+
         template <std::size_t Dimensions, typename Scalar>
         static Scalar distance(const std::array<Scalar, Dimensions>& location1,
                                const std::array<Scalar, Dimensions>& location2)
         {
-            auto sqr = [](Scalar v) { return v * v; };
             Scalar dist = 0;
             for (std::size_t i = 0; i < Dimensions; i++)
             {
-                dist += sqr(location1[i] - location2[i]);
+                dist += coordinateDistance(location1[i], location2[i]);
             }
             return dist;
         }
+
+        template <typename Scalar>
+        static Scalar coordinateDistance(Scalar coordinate1, Scalar coordinate2)
+        {
+            Scalar v = coordinate1 - coordinate2;
+            return v * v;
+        }
     };
 
-    template <class Payload,
-              std::size_t Dimensions,
-              std::size_t BucketSize = 32,
-              class Distance = SquaredL2,
-              typename Scalar = double>
-    class KDTree
+    // whether Distance provides coordinateDistance()
+    template <class Distance, typename Scalar>
+    struct HasCoordinateDistance
     {
-    private:
-        struct Node;
-        std::vector<Node> m_nodes;
-        std::set<std::size_t> waitingForSplit;
+        template <class D>
+        static auto test(int) -> decltype(D::coordinateDistance(Scalar(), Scalar()), std::true_type());
+        template <class D>
+        static std::false_type test(...);
+        static const bool value = decltype(test<Distance>(0))::value;
+    };
 
-    public:
-        using distance_t = Distance;
-        using scalar_t = Scalar;
-        using payload_t = Payload;
-        using point_t = std::array<Scalar, Dimensions>;
-        static const std::size_t dimensions = Dimensions;
-        static const std::size_t bucketSize = BucketSize;
-        using tree_t = KDTree<Payload, Dimensions, BucketSize, Distance, Scalar>;
+    // whether Distance declares that its sum over the dimensions never gets smaller
+    template <class Distance>
+    struct IsMonotonic
+    {
+        template <class D>
+        static auto test(int) -> std::integral_constant<bool, D::monotonic>;
+        template <class D>
+        static std::false_type test(...);
+        static const bool value = decltype(test<Distance>(0))::value;
+    };
 
-        KDTree() { m_nodes.emplace_back(BucketSize); } // initialize the root node
+    // Layouts choose how the coordinates of the points in a bucket are stored. The payloads are always stored apart
+    // from the coordinates, so they are only read for points which make it into the results.
 
-        size_t size() const { return m_nodes[0].m_entries; }
+    // The coordinates of each point are stored together: x0 y0 z0 x1 y1 z1 ...
+    struct PointMajorLayout
+    {
+        static const bool dimensionMajor = false;
+    };
 
-        void addPoint(const point_t& location, const Payload& payload, bool autosplit = true)
-        {
-            std::size_t addNode = 0;
+    // Each coordinate of the points in a bucket is stored together: x0 x1 ... y0 y1 ... z0 z1 ... With a distance
+    // that has coordinateDistance(), this lets the compiler vectorize scanning a bucket across its points.
+    struct DimensionMajorLayout
+    {
+        static const bool dimensionMajor = true;
+    };
 
-            while (m_nodes[addNode].m_splitDimension != Dimensions)
-            {
-                m_nodes[addNode].expandBounds(location);
-                if (location[m_nodes[addNode].m_splitDimension] < m_nodes[addNode].m_splitValue)
-                {
-                    addNode = m_nodes[addNode].m_children.first;
-                }
-                else
-                {
-                    addNode = m_nodes[addNode].m_children.second;
-                }
-            }
-            m_nodes[addNode].add(LocationPayload {location, payload});
+    // A vector made of chunks of ChunkSize elements, which are never moved once they are added. Growing it allocates
+    // one more chunk instead of moving every element to a larger array, so adding an element takes a bounded time.
+    template <class T, class Alloc, std::size_t ChunkSize>
+    class ChunkedVector
+    {
+        static_assert(ChunkSize > 0, "ChunkSize must be at least 1");
+        using traits = std::allocator_traits<Alloc>;
+        using chunk_alloc_t = typename traits::template rebind_alloc<T*>;
 
-            if (m_nodes[addNode].shouldSplit() && m_nodes[addNode].m_entries % BucketSize == 0)
-            {
-                if (autosplit)
-                {
-                    split(addNode);
-                }
-                else
-                {
-                    waitingForSplit.insert(addNode);
-                }
-            }
+    public:
+        using value_type = T;
+        using allocator_type = Alloc;
+
+        explicit ChunkedVector(const Alloc& allocator = Alloc())
+            : m_allocator(allocator), m_chunks(chunk_alloc_t(allocator))
+        {
         }
 
-        void splitOutstanding()
+        ChunkedVector(std::size_t count, const T& value, const Alloc& allocator) : ChunkedVector(allocator)
         {
-            std::vector<std::size_t> searchStack(waitingForSplit.begin(), waitingForSplit.end());
-            waitingForSplit.clear();
-            while (searchStack.size() > 0)
+            resize(count, value);
+        }
+
+        ChunkedVector(const ChunkedVector& other)
+            : ChunkedVector(traits::select_on_container_copy_construction(other.m_allocator))
+        {
+            reserve(other.size());
+            for (std::size_t i = 0; i < other.size(); i++)
             {
-                std::size_t addNode = searchStack.back();
-                searchStack.pop_back();
-                if (m_nodes[addNode].m_splitDimension == Dimensions && m_nodes[addNode].shouldSplit() && split(addNode))
-                {
-                    searchStack.push_back(m_nodes[addNode].m_children.first);
-                    searchStack.push_back(m_nodes[addNode].m_children.second);
-                }
+                push_back(other[i]);
             }
         }
 
-        struct DistancePayload
+        ChunkedVector(ChunkedVector&& other) noexcept
+            : m_allocator(other.m_allocator), m_chunks(std::move(other.m_chunks)), m_size(other.m_size)
         {
-            Scalar distance;
-            Payload payload;
-            bool operator<(const DistancePayload& dp) const { return distance < dp.distance; }
-        };
+            other.m_chunks.clear();
+            other.m_size = 0;
+        }
 
-        std::vector<DistancePayload> searchKnn(const point_t& location, std::size_t maxPoints) const
+        ChunkedVector& operator=(ChunkedVector other) noexcept
         {
-            return searcher().search(location, std::numeric_limits<Scalar>::max(), maxPoints);
+            std::swap(m_allocator, other.m_allocator);
+            std::swap(m_chunks, other.m_chunks);
+            std::swap(m_size, other.m_size);
+            return *this;
         }
 
-        std::vector<DistancePayload> searchBall(const point_t& location, Scalar maxRadius) const
+        ~ChunkedVector()
         {
-            return searcher().search(location, maxRadius, std::numeric_limits<std::size_t>::max());
+            clear();
+            shrink_to_fit();
         }
 
-        std::vector<DistancePayload> searchCapacityLimitedBall(const point_t& location,
-                                                               Scalar maxRadius,
-                                                               std::size_t maxPoints) const
+        Alloc get_allocator() const { return m_allocator; }
+
+        std::size_t size() const { return m_size; }
+        std::size_t capacity() const { return m_chunks.size() * ChunkSize; }
+
+        T& operator[](std::size_t index) { return m_chunks[index / ChunkSize][index % ChunkSize]; }
+        const T& operator[](std::size_t index) const { return m_chunks[index / ChunkSize][index % ChunkSize]; }
+        T& back() { return (*this)[m_size - 1]; }
+
+        void reserve(std::size_t count)
         {
-            return searcher().search(location, maxRadius, maxPoints);
+            while (capacity() < count)
+            {
+                m_chunks.push_back(traits::allocate(m_allocator, ChunkSize));
+            }
         }
 
-        DistancePayload search(const point_t& location) const
+        template <class... Args>
+        void emplace_back(Args&&... args)
         {
-            DistancePayload result;
-            result.distance = std::numeric_limits<Scalar>::infinity();
+            reserve(m_size + 1);
+            traits::construct(m_allocator, &(*this)[m_size], std::forward<Args>(args)...);
+            m_size++;
+        }
 
-            if (m_nodes[0].m_entries > 0)
-            {
-                std::vector<std::size_t> searchStack;
-                searchStack.reserve(1 + std::size_t(1.5 * std::log2(1 + m_nodes[0].m_entries / BucketSize)));
-                searchStack.push_back(0);
+        void push_back(const T& value) { emplace_back(value); }
 
-                while (searchStack.size() > 0)
-                {
-                    std::size_t nodeIndex = searchStack.back();
-                    searchStack.pop_back();
-                    const Node& node = m_nodes[nodeIndex];
-                    if (result.distance > node.pointRectDist(location))
-                    {
-                        if (node.m_splitDimension == Dimensions)
-                        {
-                            for (const auto& lp : node.m_locationPayloads)
-                            {
-                                Scalar nodeDist = Distance::distance(location, lp.location);
-                                if (nodeDist < result.distance)
-                                {
-                                    result = DistancePayload {nodeDist, lp.payload};
-                                }
-                            }
-                        }
-                        else
-                        {
-                            node.queueChildren(location, searchStack);
-                        }
-                    }
-                }
+        void pop_back() { traits::destroy(m_allocator, &(*this)[--m_size]); }
+
+        void resize(std::size_t count) { resize(count, T()); }
+
+        void resize(std::size_t count, const T& value)
+        {
+            while (m_size > count)
+            {
+                pop_back();
+            }
+            reserve(count);
+            while (m_size < count)
+            {
+                emplace_back(value);
             }
-            return result;
         }
 
-        class Searcher
-        {
-        public:
-            Searcher(const tree_t& tree) : m_tree(tree) { }
-            Searcher(const Searcher& searcher) : m_tree(searcher.m_tree) { }
+        void clear() { resize(0); }
 
-            // NB! this method is not const. Do not call this on same instance from different threads simultaneously.
-            const std::vector<DistancePayload>& search(const point_t& location, Scalar maxRadius, std::size_t maxPoints)
+        // frees the chunks after the last one in use
+        void shrink_to_fit()
+        {
+            while (capacity() >= m_size + ChunkSize)
             {
-                // clear results from last time
-                m_results.clear();
+                traits::deallocate(m_allocator, m_chunks.back(), ChunkSize);
+                m_chunks.pop_back();
+            }
+            m_chunks.shrink_to_fit();
+        }
 
-                // reserve capacities
-                m_searchStack.reserve(1 + std::size_t(1.5 * std::log2(1 + m_tree.m_nodes[0].m_entries / BucketSize)));
-                if (m_prioqueueCapacity < maxPoints && maxPoints < m_tree.m_nodes[0].m_entries)
-                {
-                    std::vector<DistancePayload> container;
-                    container.reserve(maxPoints);
-                    m_prioqueue = std::priority_queue<DistancePayload, std::vector<DistancePayload>>(
-                        std::less<DistancePayload>(), std::move(container));
-                    m_prioqueueCapacity = maxPoints;
-                }
+    private:
+        Alloc m_allocator;
+        std::vector<T*, chunk_alloc_t> m_chunks;
+        std::size_t m_size = 0;
+    };
 
-                m_tree.searchCapacityLimitedBall(location, maxRadius, maxPoints, m_searchStack, m_prioqueue, m_results);
+    // Node storages choose the container the nodes of a tree are kept in, which must have the interface of a
+    // std::vector that ChunkedVector has.
 
-                m_prioqueueCapacity = std::max(m_prioqueueCapacity, m_results.size());
-                return m_results;
-            }
+    // The nodes are kept in one array. This is the fastest to search, but when it runs out of space every node is moved
+    // to a new array twice as large, which can make adding a point to a large tree take a long time.
+    struct ContiguousNodes
+    {
+        template <class T, class Alloc>
+        using container_t = std::vector<T, Alloc>;
+    };
 
-        private:
-            const tree_t& m_tree;
+    // The nodes are kept in a ChunkedVector, so they are never moved or copied as the tree grows, at the cost of an
+    // extra lookup for each node visited by a search. The points are still copied. ChunkSize should be a power of two.
+    template <std::size_t ChunkSize = 1024>
+    struct ChunkedNodes
+    {
+        template <class T, class Alloc>
+        using container_t = ChunkedVector<T, Alloc, ChunkSize>;
+    };
 
-            std::vector<std::size_t> m_searchStack;
-            std::priority_queue<DistancePayload, std::vector<DistancePayload>> m_prioqueue;
-            std::size_t m_prioqueueCapacity = 0;
-            std::vector<DistancePayload> m_results;
-        };
+    // Split policies choose how a full bucket is divided in two. split() gets the points of the bucket in
+    // [first, last), which it may reorder, and their bounding box with a min and max for each dimension. Points with a
+    // coordinate in `dimension` less than `value` go to the left child and the rest go to the right. Returns false if
+    // there is no split which would put points on both sides.
+    // With PointMajorLayout the iterators refer to the points where they are stored in the tree, and dereference to
+    // proxies with a `location` that can be indexed by dimension. Compare them with a functor like LessInDimension,
+    // since a lambda taking the iterator's value_type copies the point for every comparison.
 
-        // NB! returned class has no const methods. Get one instance per thread!
-        Searcher searcher() const { return Searcher(*this); }
+    // Orders the entries of a bucket by their coordinate in `dimension`. The entries may be different types, such as
+    // a point taken out of a bucket and a reference to one still in it, so this isn't a lambda.
+    struct LessInDimension
+    {
+        std::size_t dimension;
 
-    private:
-        struct LocationPayload
+        template <class Entry1, class Entry2>
+        bool operator()(const Entry1& entry1, const Entry2& entry2) const
         {
-            point_t location;
-            Payload payload;
-        };
-        std::vector<LocationPayload> m_bucketRecycle;
+            return entry1.location[dimension] < entry2.location[dimension];
+        }
+    };
 
-        void searchCapacityLimitedBall(const point_t& location,
-                                       Scalar maxRadius,
-                                       std::size_t maxPoints,
-                                       std::vector<std::size_t>& searchStack,
-                                       std::priority_queue<DistancePayload, std::vector<DistancePayload>>& prioqueue,
-                                       std::vector<DistancePayload>& results) const
+    // Splits the widest dimension of the bounding box at the median point. This gives a balanced tree.
+    struct MedianSplit
+    {
+        template <class Iterator, class Bounds, typename Scalar>
+        static bool split(Iterator first, Iterator last, const Bounds& bounds, std::size_t& dimension, Scalar& value)
         {
-            std::size_t numSearchPoints = std::min(maxPoints, m_nodes[0].m_entries);
-
-            if (numSearchPoints > 0)
+            dimension = widestDimension<Scalar>(bounds);
+            if (dimension == bounds.size())
             {
-                searchStack.push_back(0);
-                while (searchStack.size() > 0)
-                {
-                    std::size_t nodeIndex = searchStack.back();
-                    searchStack.pop_back();
-                    const Node& node = m_nodes[nodeIndex];
-                    Scalar minDist = node.pointRectDist(location);
-                    if (maxRadius > minDist
-                        && (prioqueue.size() < numSearchPoints || prioqueue.top().distance > minDist))
-                    {
-                        if (node.m_splitDimension == Dimensions)
-                        {
-                            node.searchCapacityLimitedBall(location, maxRadius, numSearchPoints, prioqueue);
-                        }
-                        else
-                        {
-                            node.queueChildren(location, searchStack);
-                        }
-                    }
-                }
-
-                results.reserve(prioqueue.size());
-                while (prioqueue.size() > 0)
-                {
-                    results.push_back(prioqueue.top());
-                    prioqueue.pop();
-                }
-                std::reverse(results.begin(), results.end());
+                return false;
             }
+
+            // split halfway between the two middle values
+            const std::size_t dim = dimension;
+            const LessInDimension lessInDim {dim};
+            const std::size_t half = std::size_t(last - first) / 2;
+            std::nth_element(first, first + half + 1, last, lessInDim);
+            Scalar upper = (first + half + 1)->location[dim];
+            Scalar lower = std::max_element(first, first + half + 1, lessInDim)->location[dim];
+            value = (lower + upper) / Scalar(2);
+            return true;
         }
 
-        bool split(std::size_t index)
+        template <typename Scalar, class Bounds>
+        static std::size_t widestDimension(const Bounds& bounds)
         {
-            if (m_nodes.capacity() < m_nodes.size() + 2)
-            {
-                m_nodes.reserve((m_nodes.capacity() + 1) * 2);
-            }
-            Node& splitNode = m_nodes[index];
-            splitNode.m_splitDimension = Dimensions;
+            std::size_t dimension = bounds.size();
             Scalar width(0);
-            // select widest dimension
-            for (std::size_t i = 0; i < Dimensions; i++)
+            for (std::size_t i = 0; i < bounds.size(); i++)
             {
-                Scalar dWidth = splitNode.m_bounds[i].max - splitNode.m_bounds[i].min;
+                Scalar dWidth = bounds[i].max - bounds[i].min;
                 if (dWidth > width)
                 {
-                    splitNode.m_splitDimension = i;
+                    dimension = i;
                     width = dWidth;
                 }
             }
-            if (splitNode.m_splitDimension == Dimensions)
+            return dimension;
+        }
+    };
+
+    // Splits the widest dimension of the bounding box in the middle, unless all the points are on one side, in which
+    // case the split slides over to the closest point. Cells stay close to square, which suits clustered data better
+    // than the median, at the cost of a less balanced tree.
+    struct SlidingMidpointSplit
+    {
+        template <class Iterator, class Bounds, typename Scalar>
+        static bool split(Iterator first, Iterator last, const Bounds& bounds, std::size_t& dimension, Scalar& value)
+        {
+            dimension = MedianSplit::widestDimension<Scalar>(bounds);
+            if (dimension == bounds.size())
             {
                 return false;
             }
+            value = (bounds[dimension].min + bounds[dimension].max) / Scalar(2);
 
-            std::vector<Scalar> splitDimVals;
-            splitDimVals.reserve(splitNode.m_entries);
-            for (const auto& lp : splitNode.m_locationPayloads)
+            Scalar lowest = std::numeric_limits<Scalar>::max();
+            Scalar highest = std::numeric_limits<Scalar>::lowest();
+            std::size_t below = 0;
+            for (auto it = first; it != last; ++it)
             {
-                splitDimVals.push_back(lp.location[splitNode.m_splitDimension]);
+                const Scalar coordinate = it->location[dimension];
+                lowest = std::min(lowest, coordinate);
+                highest = std::max(highest, coordinate);
+                below += coordinate < value ? 1 : 0;
             }
-            std::nth_element(
-                splitDimVals.begin(), splitDimVals.begin() + splitDimVals.size() / 2 + 1, splitDimVals.end());
-            std::nth_element(splitDimVals.begin(),
-                             splitDimVals.begin() + splitDimVals.size() / 2,
-                             splitDimVals.begin() + splitDimVals.size() / 2 + 1);
-            splitNode.m_splitValue
-                = (splitDimVals[splitDimVals.size() / 2] + splitDimVals[splitDimVals.size() / 2 + 1]) / Scalar(2);
-
-            splitNode.m_children = std::make_pair(m_nodes.size(), m_nodes.size() + 1);
-            std::size_t entries = splitNode.m_entries;
-            m_nodes.emplace_back(m_bucketRecycle, entries);
-            Node& leftNode = m_nodes.back();
-            m_nodes.emplace_back(entries);
-            Node& rightNode = m_nodes.back();
 
-            for (const auto& lp : splitNode.m_locationPayloads)
+            if (below == 0) // only the lowest points go left
             {
-                if (lp.location[splitNode.m_splitDimension] < splitNode.m_splitValue)
+                value = highest;
+                for (auto it = first; it != last; ++it)
                 {
-                    leftNode.add(lp);
-                }
-                else
-                {
-                    rightNode.add(lp);
+                    const Scalar coordinate = it->location[dimension];
+                    if (coordinate > lowest && coordinate < value)
+                    {
+                        value = coordinate;
+                    }
                 }
             }
-
-            if (leftNode.m_entries == 0) // points with equality to splitValue go in rightNode
-            {
-                splitNode.m_splitValue = 0;
-                splitNode.m_splitDimension = Dimensions;
-                splitNode.m_children = std::pair<std::size_t, std::size_t>(0, 0);
-                std::swap(rightNode.m_locationPayloads, m_bucketRecycle);
-                m_nodes.pop_back();
-                m_nodes.pop_back();
-                return false;
-            }
-            else
+            else if (below == std::size_t(last - first)) // only the highest points go right
             {
-                splitNode.m_locationPayloads.clear();
-                // if it was a standard sized bucket, recycle the memory to reduce allocator pressure
-                // otherwise clear the memory used by the bucket since it is a branch not a leaf anymore
-                if (splitNode.m_locationPayloads.capacity() == BucketSize)
-                {
-                    std::swap(splitNode.m_locationPayloads, m_bucketRecycle);
-                }
-                else
-                {
-                    std::vector<LocationPayload> empty;
-                    std::swap(splitNode.m_locationPayloads, empty);
-                }
-                return true;
+                value = highest;
             }
+            return lowest < highest;
         }
+    };
 
-        struct Node
-        {
-            Node(std::size_t capacity) { init(capacity); }
-
-            Node(std::vector<LocationPayload>& recycle, std::size_t capacity)
-            {
-                std::swap(m_locationPayloads, recycle);
-                init(capacity);
-            }
-
-            void init(std::size_t capacity)
-            {
-                m_bounds.fill(Range {std::numeric_limits<Scalar>::max(), std::numeric_limits<Scalar>::lowest()});
-                m_locationPayloads.reserve(std::max(BucketSize, capacity));
-            }
+    // Splits where the number of points times the half perimeter of the bounding box, summed over both children, is the
+    // lowest. This estimates the expected cost of queries reaching each child, so it prefers to cut through empty space
+    // and keeps clusters together. Candidate splits are between `bins` equal slices of each dimension.
+    struct SurfaceAreaSplit
+    {
+        static const std::size_t bins = 16;
 
-            void expandBounds(const point_t& location)
+        template <class Iterator, class Bounds, typename Scalar>
+        static bool split(Iterator first, Iterator last, const Bounds& bounds, std::size_t& dimension, Scalar& value)
+        {
+            struct Bin
             {
-                for (std::size_t i = 0; i < Dimensions; i++)
+                std::size_t count;
+                Scalar min, max;
+                void add(const Bin& bin)
                 {
-                    if (m_bounds[i].min > location[i])
-                    {
-                        m_bounds[i].min = location[i];
-                    }
-                    if (m_bounds[i].max < location[i])
-                    {
-                        m_bounds[i].max = location[i];
-                    }
+                    count += bin.count;
+                    min = std::min(min, bin.min);
+                    max = std::max(max, bin.max);
                 }
-                m_entries++;
-            }
+            };
+            const Bin emptyBin {0, std::numeric_limits<Scalar>::max(), std::numeric_limits<Scalar>::lowest()};
 
-            void add(const LocationPayload& lp)
+            Scalar halfPerimeter(0);
+            for (std::size_t d = 0; d < bounds.size(); d++)
             {
-                expandBounds(lp.location);
-                m_locationPayloads.push_back(lp);
+                halfPerimeter += bounds[d].max - bounds[d].min;
             }
 
-            bool shouldSplit() const { return m_entries >= BucketSize; }
-
-            void searchCapacityLimitedBall(const point_t& location,
-                                           Scalar maxRadius,
-                                           std::size_t K,
-                                           std::priority_queue<DistancePayload>& results) const
+            dimension = bounds.size();
+            Scalar bestCost = std::numeric_limits<Scalar>::max();
+            for (std::size_t d = 0; d < bounds.size(); d++)
             {
-                std::size_t i = 0;
-
-                // this fills up the queue if it isn't full yet
-                for (; results.size() < K && i < m_entries; i++)
+                const Scalar width = bounds[d].max - bounds[d].min;
+                if (!(width > 0))
                 {
-                    const auto& lp = m_locationPayloads[i];
-                    Scalar distance = Distance::distance(location, lp.location);
-                    if (distance < maxRadius)
-                    {
-                        results.emplace(DistancePayload {distance, lp.payload});
-                    }
+                    continue;
                 }
 
-                // this adds new things to the queue once it is full
-                for (; i < m_entries; i++)
+                std::array<Bin, bins> binned;
+                binned.fill(emptyBin);
+                for (auto it = first; it != last; ++it)
                 {
-                    const auto& lp = m_locationPayloads[i];
-                    Scalar distance = Distance::distance(location, lp.location);
-                    if (distance < maxRadius && distance < results.top().distance)
-                    {
-                        results.pop();
-                        results.emplace(DistancePayload {distance, lp.payload});
-                    }
+                    const Scalar coordinate = it->location[d];
+                    const Scalar slice = (coordinate - bounds[d].min) / width * Scalar(bins);
+                    Bin& bin = binned[std::min(bins - 1, std::size_t(std::max(Scalar(0), slice)))];
+                    bin.add(Bin {1, coordinate, coordinate});
                 }
-            }
 
-            void queueChildren(const point_t& location, std::vector<std::size_t>& searchStack) const
-            {
-                if (location[m_splitDimension] < m_splitValue)
+                // sweep the candidate splits, with everything right of the split accumulated up front
+                std::array<Bin, bins> right;
+                right[bins - 1] = binned[bins - 1];
+                for (std::size_t b = bins - 1; b > 0; b--)
                 {
-                    searchStack.push_back(m_children.second);
-                    searchStack.push_back(m_children.first); // left is popped first
+                    right[b - 1] = right[b];
+                    right[b - 1].add(binned[b - 1]);
                 }
-                else
+                Bin left = emptyBin;
+                for (std::size_t b = 1; b < bins; b++)
                 {
-                    searchStack.push_back(m_children.first);
-                    searchStack.push_back(m_children.second); // right is popped first
+                    left.add(binned[b - 1]);
+                    if (left.count == 0 || right[b].count == 0)
+                    {
+                        continue;
+                    }
+                    const Scalar otherWidths = halfPerimeter - width;
+                    const Scalar cost = Scalar(left.count) * (otherWidths + left.max - left.min)
+                        + Scalar(right[b].count) * (otherWidths + right[b].max - right[b].min);
+                    if (cost < bestCost)
+                    {
+                        bestCost = cost;
+                        dimension = d;
+                        // split in the middle of the gap between the two sides
+                        value = left.max + (right[b].min - left.max) / Scalar(2);
+                        if (!(value > left.max))
+                        {
+                            value = right[b].min;
+                        }
+                    }
                 }
             }
+            return dimension != bounds.size();
+        }
+    };
 
-            Scalar pointRectDist(const point_t& location) const
-            {
-                auto clamp = [](Scalar v, Range r) { return std::max(r.min, std::min(r.max, v)); };
+    template <class Payload,
+              std::size_t Dimensions,
+              std::size_t BucketSize,
+              class Distance,
+              typename Scalar,
+              class SplitPolicy,
+              class Layout,
+              typename Index,
+              class Allocator,
+              typename BoundsScalar,
+              class NodeStorage>
+    class FrozenKDTree;
 
-                point_t closestBoundsPoint;
+    // Keeps the search stack, priority queue and results of a KDTree or FrozenKDTree between searches, so that they
+    // don't have to be allocated again for every search
+    template <class Tree>
+    class TreeSearcher
+    {
+    public:
+        using point_t = typename Tree::point_t;
+        using DistancePayload = typename Tree::DistancePayload;
 
-                for (std::size_t i = 0; i < Dimensions; i++)
-                {
-                    closestBoundsPoint[i] = clamp(location[i], m_bounds[i]);
-                }
-                return Distance::distance(closestBoundsPoint, location);
+        TreeSearcher(const Tree& tree) : m_tree(tree) { }
+        TreeSearcher(const TreeSearcher& searcher) : m_tree(searcher.m_tree) { }
+
+        // NB! this method is not const. Do not call this on same instance from different threads simultaneously.
+        const std::vector<DistancePayload>&
+        search(const point_t& location, typename Tree::scalar_t maxRadius, std::size_t maxPoints)
+        {
+            // clear results from last time
+            m_results.clear();
+
+            // reserve capacities
+            m_searchStack.reserve(1 + std::size_t(1.5 * std::log2(1 + m_tree.size() / Tree::bucketSize)));
+            if (m_prioqueueCapacity < maxPoints && maxPoints < m_tree.size())
+            {
+                std::vector<DistancePayload> container;
+                container.reserve(maxPoints);
+                m_prioqueue = std::priority_queue<DistancePayload, std::vector<DistancePayload>>(
+                    std::less<DistancePayload>(), std::move(container));
+                m_prioqueueCapacity = maxPoints;
             }
 
-            std::size_t m_entries = 0; /// size of the tree, or subtree
+            m_visitedNodes = m_tree.searchCapacityLimitedBall(
+                location, maxRadius, maxPoints, m_searchStack, m_prioqueue, m_results);
 
-            std::size_t m_splitDimension = Dimensions; /// split dimension of this node
-            Scalar m_splitValue = 0; /// split value of this node
+            m_prioqueueCapacity = std::max(m_prioqueueCapacity, m_results.size());
+            return m_results;
+        }
 
-            struct Range
-            {
-                Scalar min, max;
-            };
-            std::array<Range, Dimensions> m_bounds; /// bounding box of this node
+        // the number of nodes the last search looked at, useful for tuning the bucket size and split policy
+        std::size_t visitedNodes() const { return m_visitedNodes; }
 
-            std::pair<std::size_t, std::size_t> m_children; /// subtrees of this node (if not a leaf)
-            std::vector<LocationPayload> m_locationPayloads; /// data held in this node (if a leaf)
-        };
+    private:
+        const Tree& m_tree;
+
+        typename Tree::SearchStack m_searchStack;
+        std::priority_queue<DistancePayload, std::vector<DistancePayload>> m_prioqueue;
+        std::size_t m_prioqueueCapacity = 0;
+        std::vector<DistancePayload> m_results;
+        std::size_t m_visitedNodes = 0;
+    };
+
+    template <class Payload,
+              std::size_t Dimensions,
+              std::size_t BucketSize = 32,
+              class Distance = SquaredL2,
+              typename Scalar = double,
+              class SplitPolicy = MedianSplit,
+              class Layout = PointMajorLayout,
+              typename Index = std::size_t,
+              class Allocator = std::allocator<char>,
+              typename BoundsScalar = Scalar,
+              class NodeStorage = ContiguousNodes>
+    class KDTree
+    {
+        static_assert(std::is_integral<Index>::value && std::is_unsigned<Index>::value,
+                      "Index must be an unsigned integer type");
+        static_assert(std::is_void<Payload>::value || std::is_default_constructible<Payload>::value,
+                      "Payload must be default constructible");
+
+    private:
+        template <class, std::size_t, std::size_t, class, typename, class, class, typename, class, typename, class>
+        friend class KDForest;
+        template <class, std::size_t, std::size_t, class, typename, class, class, typename, class, typename, class>
+        friend class KDWindow;
+        template <class, std::size_t, std::size_t, class, typename, class, class, typename, class, typename, class>
+        friend class FrozenKDTree;
+        template <class, std::size_t, std::size_t, class, typename, class, class, typename, class, typename, class>
+        friend class IndirectKDTree;
+
+        // the memory of the tree is allocated through copies of the allocator, rebound to the type being allocated
+        template <class T>
+        using alloc_t = typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+        template <class T>
+        using vector_t = std::vector<T, alloc_t<T>>;
+        template <class T>
+        using node_vector_t = typename NodeStorage::template container_t<T, alloc_t<T>>;
+        using index_set_t = std::set<Index, std::less<Index>, alloc_t<Index>>;
+
+        struct Node;
+        struct Contents;
+        node_vector_t<Node> m_nodes; /// what is needed to traverse the tree, kept small to make the most of the cache
+        node_vector_t<Contents> m_contents; /// the number of points under each node, and the slots of leaves
+        vector_t<Index> m_freeNodes; /// nodes left unused by merging, to be reused by splitting
+        index_set_t waitingForSplit;
+        double m_maxImbalance = 1; /// largest fraction of a subtree's points allowed in one child before rebuilding
+        double m_rebuildCredit = 0; /// number of points that can be rebuilt before more points need to be added
+
+    public:
+        using distance_t = Distance;
+        using split_policy_t = SplitPolicy;
+        using layout_t = Layout;
+        using index_t = Index;
+        using allocator_t = Allocator;
+        using scalar_t = Scalar;
+        using payload_t = typename std::conditional<std::is_void<Payload>::value, Index, Payload>::type;
+        using point_t = std::array<Scalar, Dimensions>;
+        static const std::size_t dimensions = Dimensions;
+        static const std::size_t bucketSize = BucketSize;
+        using tree_t = KDTree<Payload,
+                              Dimensions,
+                              BucketSize,
+                              Distance,
+                              Scalar,
+                              SplitPolicy,
+                              Layout,
+                              Index,
+                              Allocator,
+                              BoundsScalar,
+                              NodeStorage>;
+
+        KDTree() : KDTree(Allocator()) { }
+
+        explicit KDTree(const Allocator& allocator)
+            : m_nodes(alloc_t<Node>(allocator))
+            , m_contents(alloc_t<Contents>(allocator))
+            , m_freeNodes(alloc_t<Index>(allocator))
+            , waitingForSplit(std::less<Index>(), alloc_t<Index>(allocator))
+            , m_points(allocator)
+        {
+            // initialize the root node
+            m_nodes.emplace_back();
+            m_contents.emplace_back();
+        }
+
+        // Builds a balanced tree from a range of (location, payload) pairs, or locations without payloads, see build()
+        template <class InputIterator>
+        KDTree(InputIterator first, InputIterator last, const Allocator& allocator = Allocator()) : KDTree(allocator)
+        {
+            build(first, last);
+        }
+
+        Allocator get_allocator() const { return Allocator(m_nodes.get_allocator()); }
+
+        size_t size() const { return m_contents[0].m_entries; }
+
+        // Replaces the contents of the tree with the (location, payload) pairs in [first, last), for example from a
+        // std::vector<std::pair<point_t, Payload>>. The points are copied once and then partitioned in place from the
+        // root down, so this is much faster than addPoint() followed by splitOutstanding(), and gives the same tree.
+        // Without payloads the range is of locations, which are given the indices 0, 1, 2... in order.
+        template <class InputIterator>
+        void build(InputIterator first, InputIterator last)
+        {
+            m_nextIndex = 0;
+            std::vector<LocationPayload> points;
+            for (; first != last; ++first)
+            {
+                points.push_back(locationPayload(*first, std::is_void<Payload>()));
+            }
+            build(points);
+        }
+
+        // Adds a point to a tree without payloads, returning its index, which is the number of points added to the
+        // tree before it. The index is what search results carry as their payload.
+        template <class P = Payload, typename std::enable_if<std::is_void<P>::value, int>::type = 0>
+        Index addPoint(const point_t& location, bool autosplit = true)
+        {
+            const Index index = m_nextIndex;
+            addPoint(location, index, autosplit);
+            return index;
+        }
+
+        // Adds a point with a payload. Without payloads this adds the point with the index it is given, for example
+        // to add a removed point back, and the index of the next point added without one is counted on from it.
+        void addPoint(const point_t& location, const payload_t& payload, bool autosplit = true)
+        {
+            std::size_t addNode = 0;
+
+            while (m_nodes[addNode].m_splitDimension != Dimensions)
+            {
+                m_nodes[addNode].expandBounds(location);
+                m_contents[addNode].m_entries++;
+                if (location[m_nodes[addNode].m_splitDimension] < m_nodes[addNode].m_splitValue)
+                {
+                    addNode = m_nodes[addNode].m_children.first;
+                }
+                else
+                {
+                    addNode = m_nodes[addNode].m_children.second;
+                }
+            }
+            reserveBucket(addNode, 1);
+            countIndex(payload, std::is_void<Payload>());
+            Contents& bucket = m_contents[addNode];
+            m_points.store(bucket.m_slots, bucket.m_entries++, LocationPayload {location, payload});
+            m_nodes[addNode].expandBounds(location);
+
+            if (bucket.shouldSplit() && bucket.m_entries % BucketSize == 0)
+            {
+                if (autosplit)
+                {
+                    split(addNode);
+                }
+                else
+                {
+                    waitingForSplit.insert(addNode);
+                }
+            }
+
+            if (autosplit && m_maxImbalance < 1)
+            {
+                rebalance(location, 1);
+            }
+        }
+
+        // Sets how unbalanced the tree may get from adding points with autosplit before it is partly rebuilt, as the
+        // largest fraction of a subtree's points allowed in one of its children, between 0.5 and 1. After each point
+        // is added, the highest subtree on its path that is too unbalanced is rebuilt from its points. Around 0.6
+        // keeps query performance close to a tree built all at once, even when points arrive in order. The default of
+        // 1 turns rebuilding off. This is meant for MedianSplit, the other split policies are unbalanced on purpose.
+        // Values outside the range are clamped to it, see clampMaxImbalance().
+        void setMaxImbalance(double maxImbalance) { m_maxImbalance = clampMaxImbalance(maxImbalance); }
+
+        // Limits a max imbalance to [0.55, 1]. Rebuilding costs 1 / (2 * maxImbalance - 1) times the work of adding
+        // the points, which is unbounded at 0.5, and no split can do better than 0.5 anyway.
+        static double clampMaxImbalance(double maxImbalance)
+        {
+            return maxImbalance < 1 ? std::max(0.55, maxImbalance) : 1.0;
+        }
+
+        // Adds the (location, payload) pairs in [first, last) to the tree. The whole batch is routed down the tree
+        // together, partitioning it at each branch, so each node on the way is updated once per batch instead of once
+        // per point, and each leaf gets its new points appended in one go before being split. Without payloads the
+        // range is of locations, which are given consecutive indices in order, as if by addPoint().
+        template <class InputIterator>
+        void addPoints(InputIterator first, InputIterator last, bool autosplit = true)
+        {
+            using bounds_t = typename Node::bounds_t;
+            struct Pending
+            {
+                std::size_t node;
+                bucket_iterator first, last;
+                bounds_t bounds;
+            };
+
+            std::vector<LocationPayload> points;
+            bounds_t bounds = Node::emptyBounds();
+            for (; first != last; ++first)
+            {
+                points.push_back(locationPayload(*first, std::is_void<Payload>()));
+                Node::expandBounds(bounds, points.back().location);
+            }
+
+            std::vector<Pending> addStack;
+            if (points.size() > 0)
+            {
+                addStack.push_back(Pending {0, points.begin(), points.end(), bounds});
+            }
+            std::vector<Index> splitStack;
+            std::vector<std::pair<point_t, std::size_t>> addedTo; // a location in each bucket added to, and how many
+            while (addStack.size() > 0)
+            {
+                Pending pending = addStack.back();
+                addStack.pop_back();
+                Node& node = m_nodes[pending.node];
+                Contents& contents = m_contents[pending.node];
+                const std::size_t count = pending.last - pending.first;
+                if (node.m_splitDimension == Dimensions)
+                {
+                    reserveBucket(pending.node, count); // before the entry count includes the new points
+                }
+                node.expandBounds(pending.bounds);
+                contents.m_entries += count;
+
+                if (node.m_splitDimension != Dimensions)
+                {
+                    // partition the points between the children, keeping track of the bounds of each side
+                    Pending left {node.m_children.first, pending.first, pending.first, Node::emptyBounds()};
+                    Pending right {node.m_children.second, pending.first, pending.last, Node::emptyBounds()};
+                    for (auto it = pending.first; it != pending.last; ++it)
+                    {
+                        if (it->location[node.m_splitDimension] < node.m_splitValue)
+                        {
+                            Node::expandBounds(left.bounds, it->location);
+                            std::iter_swap(it, left.last++);
+                        }
+                        else
+                        {
+                            Node::expandBounds(right.bounds, it->location);
+                        }
+                    }
+                    right.first = left.last;
+                    for (const Pending& child : {right, left})
+                    {
+                        if (child.first != child.last)
+                        {
+                            addStack.push_back(child);
+                        }
+                    }
+                }
+                else
+                {
+                    if (autosplit && m_maxImbalance < 1)
+                    {
+                        addedTo.emplace_back(pending.first->location, count);
+                    }
+                    for (std::size_t i = 0; i < count; i++)
+                    {
+                        m_points.store(contents.m_slots, contents.m_entries - count + i, std::move(pending.first[i]));
+                    }
+                    if (contents.shouldSplit())
+                    {
+                        if (autosplit)
+                        {
+                            splitStack.push_back(pending.node);
+                        }
+                        else
+                        {
+                            waitingForSplit.insert(pending.node);
+                        }
+                    }
+                }
+            }
+            splitRecursively(m_nodes, m_contents, m_freeNodes, splitStack, m_unusedSlots);
+            reclaimUnusedSlots();
+            for (const auto& added : addedTo)
+            {
+                rebalance(added.first, added.second);
+            }
+        }
+
+        void splitOutstanding()
+        {
+            std::vector<Index> searchStack(waitingForSplit.begin(), waitingForSplit.end());
+            waitingForSplit.clear();
+            splitRecursively(m_nodes, m_contents, m_freeNodes, searchStack, m_unusedSlots);
+            reclaimUnusedSlots();
+        }
+
+        // Splits the outstanding buckets using `threads` worker threads, or one per core if `threads` is 0. Once a
+        // node is split its children are independent, so each worker builds whole subtrees into a private node array
+        // and these are stitched into the tree afterwards. Idle workers steal subtrees from the busy ones.
+        void splitOutstanding(std::size_t threads)
+        {
+            if (threads == 0)
+            {
+                threads = std::max(1u, std::thread::hardware_concurrency());
+            }
+            if (threads == 1)
+            {
+                splitOutstanding();
+                return;
+            }
+
+            // split the largest buckets here until there are enough subtrees to keep all the workers busy
+            auto fewerEntries
+                = [this](std::size_t a, std::size_t b) { return m_contents[a].m_entries < m_contents[b].m_entries; };
+            // buckets split by a later autosplit are branches now, and can't be handed to a worker as a subtree root
+            std::vector<std::size_t> subtrees;
+            for (std::size_t index : waitingForSplit)
+            {
+                if (m_nodes[index].m_splitDimension == Dimensions && m_contents[index].shouldSplit())
+                {
+                    subtrees.push_back(index);
+                }
+            }
+            waitingForSplit.clear();
+            std::make_heap(subtrees.begin(), subtrees.end(), fewerEntries);
+            while (subtrees.size() > 0 && subtrees.size() < threads * 4)
+            {
+                std::pop_heap(subtrees.begin(), subtrees.end(), fewerEntries);
+                std::size_t splitNode = subtrees.back();
+                subtrees.pop_back();
+                if (split(splitNode))
+                {
+                    const auto& children = m_nodes[splitNode].m_children;
+                    for (std::size_t child : {children.first, children.second})
+                    {
+                        if (m_contents[child].shouldSplit())
+                        {
+                            subtrees.push_back(child);
+                            std::push_heap(subtrees.begin(), subtrees.end(), fewerEntries);
+                        }
+                    }
+                }
+            }
+
+            // deal the subtrees out largest first, so every worker starts with a similar amount of work
+            std::sort_heap(subtrees.begin(), subtrees.end(), fewerEntries);
+            std::vector<std::deque<std::size_t>> queues(threads);
+            std::vector<std::mutex> queueLocks(threads);
+            for (std::size_t i = 0; i < subtrees.size(); i++)
+            {
+                queues[i % threads].push_front(subtrees[subtrees.size() - 1 - i]);
+            }
+
+            // take from the back of our own queue, or steal from the front of another worker's queue
+            auto takeSubtree = [&](std::size_t worker, std::size_t& subtree) {
+                for (std::size_t i = 0; i < threads; i++)
+                {
+                    std::size_t victim = (worker + i) % threads;
+                    std::lock_guard<std::mutex> lock(queueLocks[victim]);
+                    if (queues[victim].size() > 0)
+                    {
+                        if (victim == worker)
+                        {
+                            subtree = queues[victim].back();
+                            queues[victim].pop_back();
+                        }
+                        else
+                        {
+                            subtree = queues[victim].front();
+                            queues[victim].pop_front();
+                        }
+                        return true;
+                    }
+                }
+                return false;
+            };
+
+            // m_nodes and m_points are not resized while the workers run, as buckets are split in place, and each
+            // worker only touches the subtrees of the roots it has taken
+            struct Subtree
+            {
+                std::size_t root;
+                node_vector_t<Node> nodes;
+                node_vector_t<Contents> contents;
+            };
+            std::vector<std::vector<Subtree>> built(threads);
+            std::vector<std::size_t> unusedSlots(threads, 0); // m_unusedSlots is added up after the workers finish
+            auto work = [&](std::size_t worker) {
+                std::vector<Index> searchStack;
+                vector_t<Index> freeNodes(m_freeNodes.get_allocator());
+                std::size_t root;
+                while (takeSubtree(worker, root))
+                {
+                    Subtree subtree {root,
+                                     node_vector_t<Node>(1, m_nodes[root], m_nodes.get_allocator()),
+                                     node_vector_t<Contents>(1, m_contents[root], m_contents.get_allocator())};
+                    searchStack.push_back(0);
+                    splitRecursively(subtree.nodes, subtree.contents, freeNodes, searchStack, unusedSlots[worker]);
+                    built[worker].push_back(std::move(subtree));
+                }
+            };
+
+            std::vector<std::thread> workers;
+            for (std::size_t worker = 1; worker < threads; worker++)
+            {
+                workers.emplace_back(work, worker);
+            }
+            work(0);
+            for (auto& worker : workers)
+            {
+                worker.join();
+            }
+
+            // stitch the subtrees into the tree, the root goes back in its original place and the rest are appended
+            std::size_t totalNodes = m_nodes.size();
+            for (const auto& workerSubtrees : built)
+            {
+                for (const auto& subtree : workerSubtrees)
+                {
+                    totalNodes += subtree.nodes.size() - 1;
+                }
+            }
+            m_nodes.reserve(totalNodes);
+            m_contents.reserve(totalNodes);
+            for (auto& workerSubtrees : built)
+            {
+                for (auto& subtree : workerSubtrees)
+                {
+                    std::size_t root = subtree.root;
+                    node_vector_t<Node>& nodes = subtree.nodes;
+                    std::size_t offset = m_nodes.size() - 1;
+                    auto remap = [&](std::size_t index) { return index == 0 ? root : index + offset; };
+                    for (std::size_t i = 0; i < nodes.size(); i++)
+                    {
+                        Node& node = nodes[i];
+                        if (node.m_splitDimension != Dimensions)
+                        {
+                            node.m_children
+                                = std::make_pair(remap(node.m_children.first), remap(node.m_children.second));
+                        }
+                        if (i == 0)
+                        {
+                            m_nodes[root] = node;
+                            m_contents[root] = subtree.contents[0];
+                        }
+                        else
+                        {
+                            m_nodes.push_back(node);
+                            m_contents.push_back(subtree.contents[i]);
+                        }
+                    }
+                }
+            }
+            for (std::size_t unused : unusedSlots)
+            {
+                m_unusedSlots += unused;
+            }
+            reclaimUnusedSlots();
+        }
+
+        // Removes a point added with this location and payload, returning false if there isn't one. The slot of the
+        // point in its bucket is reused by the next point added there, and when a branch is left with half a bucket of
+        // points or less they are merged back into a single bucket. Bounds are only shrunk to fit the remaining points
+        // if `shrinkBounds` is set, otherwise they can stay larger than needed until compact() is called.
+        bool removePoint(const point_t& location, const payload_t& payload, bool shrinkBounds = false)
+        {
+            std::vector<std::size_t> path;
+            std::size_t removeNode = 0;
+            while (m_nodes[removeNode].m_splitDimension != Dimensions)
+            {
+                path.push_back(removeNode);
+                if (location[m_nodes[removeNode].m_splitDimension] < m_nodes[removeNode].m_splitValue)
+                {
+                    removeNode = m_nodes[removeNode].m_children.first;
+                }
+                else
+                {
+                    removeNode = m_nodes[removeNode].m_children.second;
+                }
+            }
+            Contents& bucket = m_contents[removeNode];
+            std::size_t index = findInBucket(bucket, location, payload);
+            if (index == bucket.m_entries)
+            {
+                return false;
+            }
+            // the point is swapped to the end of the live points in the bucket, where its slot is free for the next
+            bucket.m_entries--;
+            m_points.swap(bucket.m_slots, index, bucket.m_entries);
+            path.push_back(removeNode);
+
+            for (std::size_t i = 0; i + 1 < path.size(); i++)
+            {
+                m_contents[path[i]].m_entries--;
+            }
+            for (std::size_t i = 0; i + 1 < path.size(); i++)
+            {
+                if (m_contents[path[i]].m_entries <= BucketSize / 2)
+                {
+                    mergeSubtree(path[i]);
+                    path.resize(i + 1);
+                    break;
+                }
+            }
+
+            if (shrinkBounds)
+            {
+                for (auto it = path.rbegin(); it != path.rend(); ++it)
+                {
+                    Node& node = m_nodes[*it];
+                    if (node.m_splitDimension == Dimensions)
+                    {
+                        shrinkBucketBounds(node, m_contents[*it]);
+                    }
+                    else
+                    {
+                        node.shrinkBounds(m_nodes[node.m_children.first], m_nodes[node.m_children.second]);
+                    }
+                }
+            }
+            return true;
+        }
+
+        // Moves a point added with this location and payload to a new location, returning false if there isn't one.
+        // If the new location is on the same side of every split on the way to the point's bucket, the point stays
+        // where it is. Otherwise it is removed, shrinking the bounds it leaves, and added again. The bounds on the way
+        // are only shrunk to fit if the point moves away from an edge of its bucket's bounds, so they stay tight
+        // without looking at the other points on most moves.
+        bool updatePoint(const point_t& oldLocation, const point_t& newLocation, const payload_t& payload)
+        {
+            std::vector<std::size_t> path;
+            std::size_t updateNode = 0;
+            while (m_nodes[updateNode].m_splitDimension != Dimensions)
+            {
+                const Node& node = m_nodes[updateNode];
+                bool oldLeft = oldLocation[node.m_splitDimension] < node.m_splitValue;
+                bool newLeft = newLocation[node.m_splitDimension] < node.m_splitValue;
+                if (oldLeft != newLeft)
+                {
+                    if (!removePoint(oldLocation, payload, true))
+                    {
+                        return false;
+                    }
+                    addPoint(newLocation, payload);
+                    return true;
+                }
+                path.push_back(updateNode);
+                updateNode = oldLeft ? node.m_children.first : node.m_children.second;
+            }
+
+            const Contents& bucket = m_contents[updateNode];
+            std::size_t index = findInBucket(bucket, oldLocation, payload);
+            if (index == bucket.m_entries)
+            {
+                return false;
+            }
+            m_points.setLocation(bucket.m_slots, index, newLocation);
+            if (!m_nodes[updateNode].leavesEdge(oldLocation, newLocation))
+            {
+                path.push_back(updateNode);
+                for (std::size_t pathNode : path)
+                {
+                    Node::expandBounds(m_nodes[pathNode].m_bounds, newLocation);
+                }
+                return true;
+            }
+            // the nodes above one whose bounds don't change already contain the new location
+            const typename Node::bounds_t bounds = m_nodes[updateNode].m_bounds;
+            shrinkBucketBounds(m_nodes[updateNode], bucket);
+            bool changed = !Node::sameBounds(bounds, m_nodes[updateNode].m_bounds);
+            for (auto it = path.rbegin(); changed && it != path.rend(); ++it)
+            {
+                Node& node = m_nodes[*it];
+                changed = node.shrinkBounds(m_nodes[node.m_children.first], m_nodes[node.m_children.second]);
+            }
+            return true;
+        }
+
+        // Reclaims the slots of removed points and shrinks all the bounds to fit the remaining points. Branches with
+        // half a bucket of points or less are merged into single buckets, and the nodes and points are laid out again
+        // in depth first order, without the gaps left by merging, removing and moving buckets that ran out of slots.
+        void compact()
+        {
+            const std::size_t dropped = m_nodes.size();
+            std::vector<std::size_t> newIndices(m_nodes.size(), dropped);
+            node_vector_t<Node> nodes(m_nodes.get_allocator());
+            node_vector_t<Contents> contents(m_contents.get_allocator());
+            nodes.reserve(m_nodes.size() - m_freeNodes.size());
+            contents.reserve(m_nodes.size() - m_freeNodes.size());
+            nodes.emplace_back();
+            contents.emplace_back();
+
+            std::vector<std::pair<std::size_t, std::size_t>> compactStack; // old and new index of each node
+            compactStack.emplace_back(0, 0);
+            while (compactStack.size() > 0)
+            {
+                std::size_t oldIndex = compactStack.back().first;
+                std::size_t newIndex = compactStack.back().second;
+                compactStack.pop_back();
+                newIndices[oldIndex] = newIndex;
+
+                Node& node = m_nodes[oldIndex];
+                if (node.m_splitDimension != Dimensions && m_contents[oldIndex].m_entries <= BucketSize / 2)
+                {
+                    mergeSubtree(oldIndex);
+                }
+                if (node.m_splitDimension != Dimensions)
+                {
+                    compactStack.emplace_back(node.m_children.second, nodes.size() + 1);
+                    compactStack.emplace_back(node.m_children.first, nodes.size());
+                    node.m_children = std::make_pair(nodes.size(), nodes.size() + 1);
+                    nodes.resize(nodes.size() + 2);
+                    contents.resize(contents.size() + 2);
+                }
+                nodes[newIndex] = node;
+                contents[newIndex] = m_contents[oldIndex];
+            }
+
+            // children always come after their parent, so the bounds can be shrunk from the bottom up
+            for (std::size_t i = nodes.size(); i-- > 0;)
+            {
+                Node& node = nodes[i];
+                if (node.m_splitDimension == Dimensions)
+                {
+                    shrinkBucketBounds(node, contents[i]);
+                }
+                else
+                {
+                    node.shrinkBounds(nodes[node.m_children.first], nodes[node.m_children.second]);
+                }
+            }
+
+            std::swap(m_nodes, nodes);
+            std::swap(m_contents, contents);
+            m_freeNodes.clear();
+            repackPoints(true);
+            index_set_t stillWaiting(waitingForSplit.key_comp(), waitingForSplit.get_allocator());
+            for (std::size_t index : waitingForSplit)
+            {
+                if (newIndices[index] != dropped && m_nodes[newIndices[index]].m_splitDimension == Dimensions)
+                {
+                    stillWaiting.insert(newIndices[index]);
+                }
+            }
+            std::swap(waitingForSplit, stillWaiting);
+        }
+
+        // Gives back the memory the tree has allocated but isn't using, like after build() or removing points. The
+        // buckets are packed without free slots, so the next point added to a bucket moves it. Unlike compact(),
+        // the nodes and bounds are left as they are.
+        void shrinkToFit()
+        {
+            repackPoints(true);
+            m_nodes.shrink_to_fit();
+            m_contents.shrink_to_fit();
+            m_freeNodes.shrink_to_fit();
+        }
+
+        // The bytes allocated by the tree, split up by what they are used for. Memory allocated by the payloads
+        // themselves isn't included.
+        struct MemoryUsage
+        {
+            std::size_t nodes; /// nodes in the tree
+            std::size_t nodesReserved; /// nodes allocated, including free nodes and spare capacity
+            std::size_t points; /// coordinates and payloads of the points in the tree
+            std::size_t pointsReserved; /// point slots allocated, including free and unused slots and spare capacity
+            std::size_t freeNodes; /// list of the nodes left free by merging
+            std::size_t waitingForSplit; /// set of the buckets waiting to be split, estimated
+
+            std::size_t total() const { return nodesReserved + pointsReserved + freeNodes + waitingForSplit; }
+        };
+
+        MemoryUsage memoryUsage() const
+        {
+            const std::size_t nodeSize = sizeof(Node) + sizeof(Contents);
+            const std::size_t pointSize = Dimensions * sizeof(Scalar) + sizeof(payload_t);
+            MemoryUsage usage;
+            usage.nodes = (m_nodes.size() - m_freeNodes.size()) * nodeSize;
+            usage.nodesReserved = m_nodes.capacity() * sizeof(Node) + m_contents.capacity() * sizeof(Contents);
+            usage.points = size() * pointSize;
+            usage.pointsReserved = m_points.coordinates.capacity() * sizeof(Scalar)
+                + m_points.payloads.capacity() * sizeof(payload_t);
+            usage.freeNodes = m_freeNodes.capacity() * sizeof(Index);
+            // a tree node per entry, with a colour and three pointers in the common implementations
+            usage.waitingForSplit = waitingForSplit.size() * (sizeof(Index) + 4 * sizeof(void*));
+            return usage;
+        }
+
+        struct DistancePayload
+        {
+            Scalar distance;
+            payload_t payload;
+            bool operator<(const DistancePayload& dp) const { return distance < dp.distance; }
+        };
+
+        // The nodes waiting to be searched, each with a lower bound on the distance to its points. The nodes and
+        // bounds are kept in separate arrays, as pushing and popping pairs of them was much slower.
+        struct SearchStack
+        {
+            std::vector<Index> nodes;
+            std::vector<Scalar> minDists;
+
+            bool empty() const { return nodes.empty(); }
+
+            void reserve(std::size_t size)
+            {
+                nodes.reserve(size);
+                minDists.reserve(size);
+            }
+
+            void push(Index node, Scalar minDist)
+            {
+                nodes.push_back(node);
+                minDists.push_back(minDist);
+            }
+
+            void pop(std::size_t& node, Scalar& minDist)
+            {
+                node = nodes.back();
+                minDist = minDists.back();
+                nodes.pop_back();
+                minDists.pop_back();
+            }
+        };
+
+        std::vector<DistancePayload> searchKnn(const point_t& location, std::size_t maxPoints) const
+        {
+            return searcher().search(location, std::numeric_limits<Scalar>::max(), maxPoints);
+        }
+
+        std::vector<DistancePayload> searchBall(const point_t& location, Scalar maxRadius) const
+        {
+            return searcher().search(location, maxRadius, std::numeric_limits<std::size_t>::max());
+        }
+
+        std::vector<DistancePayload> searchCapacityLimitedBall(const point_t& location,
+                                                               Scalar maxRadius,
+                                                               std::size_t maxPoints) const
+        {
+            return searcher().search(location, maxRadius, maxPoints);
+        }
+
+        DistancePayload search(const point_t& location) const
+        {
+            DistancePayload result {};
+            result.distance = std::numeric_limits<Scalar>::infinity();
+
+            if (size() > 0)
+            {
+                SearchStack searchStack;
+                searchStack.reserve(1 + std::size_t(1.5 * std::log2(1 + size() / BucketSize)));
+                searchStack.push(0, 0);
+
+                while (!searchStack.empty())
+                {
+                    std::size_t nodeIndex;
+                    Scalar minDist;
+                    searchStack.pop(nodeIndex, minDist);
+                    if (!(result.distance > minDist)) // without looking at the bounds of the node
+                    {
+                        continue;
+                    }
+                    const Node& node = m_nodes[nodeIndex];
+                    minDist = node.pointRectDist(location);
+                    if (result.distance > minDist)
+                    {
+                        if (node.m_splitDimension == Dimensions)
+                        {
+                            const Contents& bucket = m_contents[nodeIndex];
+                            auto visit = [&](Scalar distance, std::size_t slot) {
+                                if (distance < result.distance)
+                                {
+                                    result = DistancePayload {distance, m_points.payloads[bucket.m_slots.first + slot]};
+                                }
+                            };
+                            auto bound = [&]() { return result.distance; };
+                            m_points.scan(bucket.m_slots, bucket.m_entries, location, bound, visit);
+                        }
+                        else
+                        {
+                            node.queueChildren(location, minDist, searchStack);
+                        }
+                    }
+                }
+            }
+            return result;
+        }
+
+        using Searcher = TreeSearcher<tree_t>;
+        friend Searcher;
+
+        // NB! returned class has no const methods. Get one instance per thread!
+        Searcher searcher() const { return Searcher(*this); }
+
+        using frozen_t = FrozenKDTree<Payload,
+                                      Dimensions,
+                                      BucketSize,
+                                      Distance,
+                                      Scalar,
+                                      SplitPolicy,
+                                      Layout,
+                                      Index,
+                                      Allocator,
+                                      BoundsScalar,
+                                      NodeStorage>;
+
+        // Returns a read-only copy of the tree laid out for searching, see FrozenKDTree. Buckets still waiting to be
+        // split are copied as they are, so call splitOutstanding() first if points were added without autosplit.
+        frozen_t freeze() const { return frozen_t(*this); }
+
+    private:
+        struct LocationPayload
+        {
+            point_t location;
+            payload_t payload;
+        };
+        using bucket_iterator = typename std::vector<LocationPayload>::iterator;
+
+        // the range of slots in the PointStore belonging to a bucket. The PointStore must have fewer slots than the
+        // largest Index, which isn't checked.
+        struct Slots
+        {
+            Slots() : first(0), capacity(0) { }
+            Slots(std::size_t first, std::size_t capacity) : first(Index(first)), capacity(Index(capacity)) { }
+
+            Index first;
+            Index capacity;
+
+            // index in PointStore::coordinates of the coordinate `dimension` of the point in slot `slot`
+            std::size_t coordinate(std::size_t slot, std::size_t dimension) const
+            {
+                return Dimensions * first
+                    + (Layout::dimensionMajor ? dimension * capacity + slot : slot * Dimensions + dimension);
+            }
+        };
+
+        static const std::size_t scanBlockSize = 64;
+
+        // with a monotonic Distance, how many dimensions are summed between checking whether points are too far
+        static const std::size_t abandonDimensions = 8;
+
+        static bool abandonAfter(std::size_t dimension)
+        {
+            return IsMonotonic<Distance>::value && (dimension + 1) % abandonDimensions == 0
+                && dimension + 1 < Dimensions;
+        }
+
+        // Sums up the distances from `location` to `count` points, at most scanBlockSize, starting at `coordinates`.
+        // With DimensionMajorLayout this goes a dimension at a time across the points, `dimensionStride` apart, and
+        // otherwise a point at a time. The points closer than `bound` are picked out without branches, their indices
+        // going in `near` and their distances in `nearDistances`, and the number of them is returned. With a monotonic
+        // Distance, a point stops being summed once it is as far as `bound`, and with DimensionMajorLayout the whole
+        // block once all its points are.
+        static std::size_t scanBlock(const Scalar* coordinates,
+                                     std::size_t dimensionStride,
+                                     std::size_t count,
+                                     const Scalar* location,
+                                     Scalar bound,
+                                     Scalar* nearDistances,
+                                     std::uint8_t* near)
+        {
+            std::array<Scalar, scanBlockSize> distances;
+            std::fill(distances.begin(), distances.begin() + count, Scalar(0));
+            for (std::size_t d = 0; Layout::dimensionMajor && d < Dimensions; d++)
+            {
+                const Scalar* dimensionCoordinates = coordinates + d * dimensionStride;
+                const Scalar coordinate = location[d];
+                for (std::size_t i = 0; i < count; i++)
+                {
+                    distances[i] += Distance::coordinateDistance(coordinate, dimensionCoordinates[i]);
+                }
+                if (abandonAfter(d))
+                {
+                    std::size_t nearCount = 0;
+                    for (std::size_t i = 0; i < count; i++)
+                    {
+                        nearCount += distances[i] < bound;
+                    }
+                    if (nearCount == 0)
+                    {
+                        return 0;
+                    }
+                }
+            }
+            for (std::size_t i = 0; !Layout::dimensionMajor && i < count; i++)
+            {
+                const Scalar* pointCoordinates = coordinates + i * Dimensions;
+                Scalar distance = 0;
+                for (std::size_t first = 0; first < Dimensions; first += abandonDimensions)
+                {
+                    const std::size_t last = std::min(first + abandonDimensions, Dimensions);
+                    for (std::size_t d = first; d < last; d++)
+                    {
+                        distance += Distance::coordinateDistance(location[d], pointCoordinates[d]);
+                    }
+                    if (IsMonotonic<Distance>::value && !(distance < bound))
+                    {
+                        break;
+                    }
+                }
+                distances[i] = distance;
+            }
+            std::size_t nearCount = 0;
+            for (std::size_t i = 0; i < count; i++)
+            {
+                near[nearCount] = std::uint8_t(i);
+                nearDistances[nearCount] = distances[i];
+                nearCount += distances[i] < bound;
+            }
+            return nearCount;
+        }
+
+        using scan_block_t = decltype(&scanBlock);
+
+#ifdef KDTREE_RUNTIME_DISPATCH
+        // AVX2 without FMA, so that the distances are rounded exactly like those from Distance::distance()
+        __attribute__((target("avx2"))) static std::size_t scanBlockAvx2(const Scalar* coordinates,
+                                                                         std::size_t dimensionStride,
+                                                                         std::size_t count,
+                                                                         const Scalar* location,
+                                                                         Scalar bound,
+                                                                         Scalar* nearDistances,
+                                                                         std::uint8_t* near)
+        {
+            return scanBlock(coordinates, dimensionStride, count, location, bound, nearDistances, near);
+        }
+#endif
+
+        static scan_block_t selectScanBlock()
+        {
+#ifdef KDTREE_RUNTIME_DISPATCH
+            __builtin_cpu_init(); // in case this is called before the constructors of the program are run
+            if (__builtin_cpu_supports("avx2"))
+            {
+                return &scanBlockAvx2;
+            }
+#endif
+            return &scanBlock;
+        }
+
+        // The points of all the buckets, each bucket in a contiguous range of slots with its coordinates laid out as
+        // chosen by Layout. Slots are indexed from the start of their bucket.
+        struct PointStore
+        {
+            explicit PointStore(const Allocator& allocator)
+                : coordinates(alloc_t<Scalar>(allocator)), payloads(alloc_t<payload_t>(allocator))
+            {
+            }
+
+            vector_t<Scalar> coordinates;
+            vector_t<payload_t> payloads;
+
+            std::size_t size() const { return payloads.size(); }
+
+            // free slots hold default constructed payloads until points are stored in them. The capacity grows by half
+            // rather than doubling, as the unused slots between buckets already take up to a quarter of the store.
+            void resize(std::size_t slots)
+            {
+                if (slots > payloads.capacity())
+                {
+                    const std::size_t reserved = std::max(slots, payloads.capacity() + payloads.capacity() / 2);
+                    coordinates.reserve(Dimensions * reserved);
+                    payloads.reserve(reserved);
+                }
+                coordinates.resize(Dimensions * slots);
+                payloads.resize(slots);
+            }
+
+            point_t location(const Slots& slots, std::size_t slot) const
+            {
+                point_t location;
+                for (std::size_t i = 0; i < Dimensions; i++)
+                {
+                    location[i] = coordinates[slots.coordinate(slot, i)];
+                }
+                return location;
+            }
+
+            void setLocation(const Slots& slots, std::size_t slot, const point_t& location)
+            {
+                for (std::size_t i = 0; i < Dimensions; i++)
+                {
+                    coordinates[slots.coordinate(slot, i)] = location[i];
+                }
+            }
+
+            void store(const Slots& slots, std::size_t slot, LocationPayload&& lp)
+            {
+                setLocation(slots, slot, lp.location);
+                payloads[slots.first + slot] = std::move(lp.payload);
+            }
+
+            LocationPayload take(const Slots& slots, std::size_t slot)
+            {
+                return LocationPayload {location(slots, slot), std::move(payloads[slots.first + slot])};
+            }
+
+            void swap(const Slots& slots, std::size_t slot1, std::size_t slot2)
+            {
+                for (std::size_t i = 0; i < Dimensions; i++)
+                {
+                    std::swap(coordinates[slots.coordinate(slot1, i)], coordinates[slots.coordinate(slot2, i)]);
+                }
+                std::swap(payloads[slots.first + slot1], payloads[slots.first + slot2]);
+            }
+
+            // moves the points in the first `count` slots of `slots` to the slots `toSlots` of `to`
+            void move(const Slots& slots, PointStore& to, const Slots& toSlots, std::size_t count)
+            {
+                for (std::size_t slot = 0; slot < count; slot++)
+                {
+                    to.store(toSlots, slot, take(slots, slot));
+                }
+            }
+
+            // copies the points in the first `count` slots of `slots` to the slots `toSlots` of `to`
+            void copy(const Slots& slots, PointStore& to, const Slots& toSlots, std::size_t count) const
+            {
+                for (std::size_t slot = 0; slot < count; slot++)
+                {
+                    to.setLocation(toSlots, slot, location(slots, slot));
+                    to.payloads[toSlots.first + slot] = payloads[slots.first + slot];
+                }
+            }
+
+            // Calls visit(distance, slot) for the first `count` points in `slots`, skipping points which aren't closer
+            // than bound(). bound() is only checked now and then, so visit() still has to check the distance itself.
+            // With a distance which has coordinateDistance(), the distances to a block of points are summed up a
+            // dimension at a time and the points closer than bound() are picked out without branches, which the
+            // compiler can vectorize. Point-major buckets of up to 4 dimensions are scanned a point at a time instead,
+            // as there is too little to vectorize in each point for blocks to pay off.
+            template <class Bound, class Visitor>
+            void scan(const Slots& slots, std::size_t count, const point_t& location, Bound&& bound, Visitor&& visit)
+                const
+            {
+                const bool vectorize
+                    = HasCoordinateDistance<Distance, Scalar>::value && (Layout::dimensionMajor || Dimensions > 4);
+                scan(slots, count, location, bound, visit, std::integral_constant<bool, vectorize>());
+            }
+
+            template <class Bound, class Visitor>
+            void scan(const Slots& slots,
+                      std::size_t count,
+                      const point_t& location,
+                      Bound&,
+                      Visitor& visit,
+                      std::false_type) const
+            {
+                for (std::size_t i = 0; i < count; i++)
+                {
+                    visit(Distance::distance(location, this->location(slots, i)), i);
+                }
+            }
+
+            template <class Bound, class Visitor>
+            void scan(const Slots& slots,
+                      std::size_t count,
+                      const point_t& location,
+                      Bound& bound,
+                      Visitor& visit,
+                      std::true_type) const
+            {
+                static const scan_block_t scanNear = selectScanBlock();
+                std::array<Scalar, scanBlockSize> distances;
+                std::array<std::uint8_t, scanBlockSize> near;
+                const std::size_t dimensionStride = Layout::dimensionMajor ? slots.capacity : 1;
+                for (std::size_t block = 0; block < count; block += scanBlockSize)
+                {
+                    const std::size_t nearCount = scanNear(coordinates.data() + slots.coordinate(block, 0),
+                                                           dimensionStride,
+                                                           std::min(std::size_t(scanBlockSize), count - block),
+                                                           location.data(),
+                                                           bound(),
+                                                           distances.data(),
+                                                           near.data());
+                    for (std::size_t i = 0; i < nearCount; i++)
+                    {
+                        visit(distances[i], block + near[i]);
+                    }
+                }
+            }
+
+            // adds the first `count` points in `slots` within maxRadius of location to `results`, keeping only the
+            // closest K
+            void search(const Slots& slots,
+                        std::size_t count,
+                        const point_t& location,
+                        Scalar maxRadius,
+                        std::size_t K,
+                        std::priority_queue<DistancePayload>& results) const
+            {
+                auto bound = [&]() {
+                    return results.size() < K ? maxRadius : std::min(maxRadius, results.top().distance);
+                };
+                scan(slots, count, location, bound, [&](Scalar distance, std::size_t slot) {
+                    if (distance < maxRadius && (results.size() < K || distance < results.top().distance))
+                    {
+                        if (results.size() == K)
+                        {
+                            results.pop();
+                        }
+                        results.emplace(DistancePayload {distance, payloads[slots.first + slot]});
+                    }
+                });
+            }
+        };
+
+        // A point in a bucket of a PointMajorLayout PointStore, which reads and writes the point where it is stored, so
+        // that split policies can reorder a bucket in place. Assigning to it assigns to the point it refers to.
+        struct SlotReference
+        {
+            Scalar* location; /// the coordinates of the point
+            payload_t* payload;
+
+            SlotReference(Scalar* location, payload_t* payload) : location(location), payload(payload) { }
+            SlotReference(const SlotReference&) = default;
+
+            operator LocationPayload() const&
+            {
+                LocationPayload lp {point_t(), *payload};
+                std::copy(location, location + Dimensions, lp.location.begin());
+                return lp;
+            }
+
+            operator LocationPayload() &&
+            {
+                LocationPayload lp {point_t(), std::move(*payload)};
+                std::copy(location, location + Dimensions, lp.location.begin());
+                return lp;
+            }
+
+            SlotReference& operator=(LocationPayload&& lp)
+            {
+                std::copy(lp.location.begin(), lp.location.end(), location);
+                *payload = std::move(lp.payload);
+                return *this;
+            }
+
+            SlotReference& operator=(const SlotReference& reference)
+            {
+                std::copy(reference.location, reference.location + Dimensions, location);
+                *payload = *reference.payload;
+                return *this;
+            }
+
+            SlotReference& operator=(SlotReference&& reference)
+            {
+                std::copy(reference.location, reference.location + Dimensions, location);
+                *payload = std::move(*reference.payload);
+                return *this;
+            }
+
+            friend void swap(SlotReference reference1, SlotReference reference2)
+            {
+                std::swap_ranges(reference1.location, reference1.location + Dimensions, reference2.location);
+                std::swap(*reference1.payload, *reference2.payload);
+            }
+        };
+
+        // iterates over the slots of a bucket in a PointMajorLayout PointStore, giving a SlotReference to each point
+        class SlotIterator
+        {
+        public:
+            using iterator_category = std::random_access_iterator_tag;
+            using value_type = LocationPayload;
+            using difference_type = std::ptrdiff_t;
+            using reference = SlotReference;
+
+            // what operator->() returns, as the SlotReference it points to is a temporary
+            struct pointer
+            {
+                SlotReference reference;
+                const SlotReference* operator->() const { return &reference; }
+            };
+
+            SlotIterator() : m_location(nullptr), m_payload(nullptr) { }
+            SlotIterator(PointStore& points, const Slots& slots, std::size_t slot)
+                : m_location(points.coordinates.data() + slots.coordinate(slot, 0))
+                , m_payload(points.payloads.data() + slots.first + slot)
+            {
+            }
+
+            reference operator*() const { return SlotReference(m_location, m_payload); }
+            pointer operator->() const { return pointer {**this}; }
+            reference operator[](difference_type n) const { return *(*this + n); }
+
+            SlotIterator& operator+=(difference_type n)
+            {
+                m_location += n * difference_type(Dimensions);
+                m_payload += n;
+                return *this;
+            }
+            SlotIterator& operator-=(difference_type n) { return *this += -n; }
+            SlotIterator& operator++() { return *this += 1; }
+            SlotIterator& operator--() { return *this -= 1; }
+            SlotIterator operator++(int)
+            {
+                SlotIterator it = *this;
+                ++*this;
+                return it;
+            }
+            SlotIterator operator--(int)
+            {
+                SlotIterator it = *this;
+                --*this;
+                return it;
+            }
+            SlotIterator operator+(difference_type n) const { return SlotIterator(*this) += n; }
+            SlotIterator operator-(difference_type n) const { return SlotIterator(*this) -= n; }
+            friend SlotIterator operator+(difference_type n, const SlotIterator& it) { return it + n; }
+            difference_type operator-(const SlotIterator& it) const { return m_payload - it.m_payload; }
+
+            bool operator==(const SlotIterator& it) const { return m_payload == it.m_payload; }
+            bool operator!=(const SlotIterator& it) const { return m_payload != it.m_payload; }
+            bool operator<(const SlotIterator& it) const { return m_payload < it.m_payload; }
+            bool operator>(const SlotIterator& it) const { return m_payload > it.m_payload; }
+            bool operator<=(const SlotIterator& it) const { return m_payload <= it.m_payload; }
+            bool operator>=(const SlotIterator& it) const { return m_payload >= it.m_payload; }
+
+        private:
+            Scalar* m_location;
+            payload_t* m_payload;
+        };
+
+        PointStore m_points;
+        std::size_t m_unusedSlots = 0; /// slots in m_points not in any bucket, reclaimed by repackPoints()
+        Index m_nextIndex = 0; /// without payloads, the index given to the next point added
+
+        template <class Pair>
+        static LocationPayload locationPayload(const Pair& pair, std::false_type)
+        {
+            return LocationPayload {pair.first, pair.second};
+        }
+
+        LocationPayload locationPayload(const point_t& location, std::true_type)
+        {
+            return LocationPayload {location, m_nextIndex++};
+        }
+
+        static void countIndex(const payload_t&, std::false_type) { }
+        void countIndex(Index index, std::true_type) { m_nextIndex = std::max<Index>(m_nextIndex, index + 1); }
+
+        // Replaces the contents of the tree with `points`, which are reordered and moved from. The buckets are laid out
+        // in depth first order without any free slots.
+        void build(std::vector<LocationPayload>& points)
+        {
+            waitingForSplit.clear();
+            m_freeNodes.clear();
+            m_nodes.clear();
+            m_contents.clear();
+            m_nodes.reserve(1 + 4 * points.size() / BucketSize);
+            m_contents.reserve(1 + 4 * points.size() / BucketSize);
+            m_nodes.emplace_back();
+            m_contents.emplace_back();
+            m_points = PointStore(get_allocator());
+            m_points.resize(points.size());
+            m_unusedSlots = 0;
+
+            struct Pending
+            {
+                std::size_t node;
+                bucket_iterator first, last;
+            };
+            std::vector<Pending> buildStack;
+            buildStack.push_back(Pending {0, points.begin(), points.end()});
+            while (buildStack.size() > 0)
+            {
+                Pending pending = buildStack.back();
+                buildStack.pop_back();
+                Node& node = m_nodes[pending.node];
+                Contents& contents = m_contents[pending.node];
+                for (auto it = pending.first; it != pending.last; ++it)
+                {
+                    node.expandBounds(it->location);
+                }
+                contents.m_entries = pending.last - pending.first;
+
+                bucket_iterator middle;
+                if (contents.shouldSplit() && partitionBucket(node, pending.first, pending.last, middle))
+                {
+                    node.m_children = std::make_pair(m_nodes.size(), m_nodes.size() + 1);
+                    buildStack.push_back(Pending {node.m_children.second, middle, pending.last});
+                    buildStack.push_back(Pending {node.m_children.first, pending.first, middle});
+                    m_nodes.resize(m_nodes.size() + 2);
+                    m_contents.resize(m_contents.size() + 2);
+                }
+                else
+                {
+                    contents.m_slots = Slots {std::size_t(pending.first - points.begin()), contents.m_entries};
+                    for (std::size_t i = 0; i < contents.m_entries; i++)
+                    {
+                        m_points.store(contents.m_slots, i, std::move(pending.first[i]));
+                    }
+                }
+            }
+        }
+
+        // Moves all the live points of the tree to the end of `points`, leaving the tree empty
+        void extractPoints(std::vector<LocationPayload>& points)
+        {
+            points.reserve(points.size() + size());
+            std::vector<std::size_t> extractStack(1, 0);
+            while (extractStack.size() > 0)
+            {
+                const Node& node = m_nodes[extractStack.back()];
+                const Contents& bucket = m_contents[extractStack.back()];
+                extractStack.pop_back();
+                if (node.m_splitDimension == Dimensions)
+                {
+                    for (std::size_t i = 0; i < bucket.m_entries; i++)
+                    {
+                        points.push_back(m_points.take(bucket.m_slots, i));
+                    }
+                }
+                else
+                {
+                    extractStack.push_back(node.m_children.first);
+                    extractStack.push_back(node.m_children.second);
+                }
+            }
+            *this = tree_t(get_allocator());
+        }
+
+        // returns the number of nodes visited
+        std::size_t
+        searchCapacityLimitedBall(const point_t& location,
+                                  Scalar maxRadius,
+                                  std::size_t maxPoints,
+                                  SearchStack& searchStack,
+                                  std::priority_queue<DistancePayload, std::vector<DistancePayload>>& prioqueue,
+                                  std::vector<DistancePayload>& results) const
+        {
+            std::size_t numSearchPoints = std::min(maxPoints, size());
+            std::size_t visitedNodes = 0;
+
+            if (numSearchPoints > 0)
+            {
+                visitedNodes = searchCapacityLimitedBall(location, maxRadius, numSearchPoints, searchStack, prioqueue);
+                popResults(prioqueue, results);
+            }
+            return visitedNodes;
+        }
+
+        // Empties `prioqueue` into `results`, closest first
+        static void popResults(std::priority_queue<DistancePayload>& prioqueue, std::vector<DistancePayload>& results)
+        {
+            results.reserve(results.size() + prioqueue.size());
+            while (prioqueue.size() > 0)
+            {
+                results.push_back(prioqueue.top());
+                prioqueue.pop();
+            }
+            std::reverse(results.begin(), results.end());
+        }
+
+        // Adds the points within maxRadius of location to `prioqueue`, keeping only the closest maxPoints. Points
+        // already in the queue are used for pruning, so several trees can be searched into the same queue.
+        // Returns the number of nodes visited.
+        std::size_t searchCapacityLimitedBall(const point_t& location,
+                                              Scalar maxRadius,
+                                              std::size_t maxPoints,
+                                              SearchStack& searchStack,
+                                              std::priority_queue<DistancePayload>& prioqueue) const
+        {
+            std::size_t visitedNodes = 0;
+            if (maxPoints == 0 || size() == 0)
+            {
+                return visitedNodes;
+            }
+
+            auto mayBeCloser = [&](Scalar minDist) {
+                return maxRadius > minDist && (prioqueue.size() < maxPoints || prioqueue.top().distance > minDist);
+            };
+            searchStack.push(0, 0);
+            while (!searchStack.empty())
+            {
+                std::size_t nodeIndex;
+                Scalar minDist;
+                searchStack.pop(nodeIndex, minDist);
+                visitedNodes++;
+                if (!mayBeCloser(minDist)) // without looking at the bounds of the node
+                {
+                    continue;
+                }
+                const Node& node = m_nodes[nodeIndex];
+                minDist = node.pointRectDist(location);
+                if (mayBeCloser(minDist))
+                {
+                    if (node.m_splitDimension == Dimensions)
+                    {
+                        const Contents& bucket = m_contents[nodeIndex];
+                        m_points.search(bucket.m_slots, bucket.m_entries, location, maxRadius, maxPoints, prioqueue);
+                    }
+                    else
+                    {
+                        node.queueChildren(location, minDist, searchStack);
+                    }
+                }
+            }
+            return visitedNodes;
+        }
+
+        // whether an entry of a bucket goes to the left child of a split
+        struct LeftOfSplit
+        {
+            std::size_t dimension;
+            Scalar value;
+
+            template <class Entry>
+            bool operator()(const Entry& entry) const
+            {
+                return entry.location[dimension] < value;
+            }
+        };
+
+        // Picks the split of `node` for its points in [first, last) and partitions them in place so that the points
+        // for the left child come first. Returns false if the points can't be split.
+        template <class Iterator>
+        static bool partitionBucket(Node& node, Iterator first, Iterator last, Iterator& middle)
+        {
+            std::size_t dim;
+            Scalar splitValue;
+            if (!SplitPolicy::split(first, last, node.m_bounds, dim, splitValue))
+            {
+                return false;
+            }
+
+            middle = std::partition(first, last, LeftOfSplit {dim, splitValue});
+            if (middle == first || middle == last) // points with equality to splitValue go in the right child
+            {
+                return false;
+            }
+            node.m_splitDimension = static_cast<typename Node::dimension_t>(dim);
+            node.m_splitValue = splitValue;
+            return true;
+        }
+
+        // splits every node on the stack that needs it, then their children, until all the buckets are small enough
+        void splitRecursively(node_vector_t<Node>& nodes,
+                              node_vector_t<Contents>& contents,
+                              vector_t<Index>& freeNodes,
+                              std::vector<Index>& searchStack,
+                              std::size_t& unusedSlots)
+        {
+            vector_t<LocationPayload> points {alloc_t<LocationPayload>(get_allocator())};
+            while (searchStack.size() > 0)
+            {
+                std::size_t addNode = searchStack.back();
+                searchStack.pop_back();
+                if (nodes[addNode].m_splitDimension == Dimensions && contents[addNode].shouldSplit()
+                    && split(nodes, contents, freeNodes, addNode, points, unusedSlots))
+                {
+                    searchStack.push_back(nodes[addNode].m_children.first);
+                    searchStack.push_back(nodes[addNode].m_children.second);
+                }
+            }
+        }
+
+        bool split(std::size_t index)
+        {
+            vector_t<LocationPayload> points {alloc_t<LocationPayload>(get_allocator())};
+            return split(m_nodes, m_contents, m_freeNodes, index, points, m_unusedSlots);
+        }
+
+        // Splits the bucket `index`, counting the slots it leaves unused in `unusedSlots`. With PointMajorLayout the
+        // points are partitioned where they are stored. With DimensionMajorLayout where a point is stored depends on
+        // the capacity of its bucket, so they are partitioned in `points`, as scratch space, and stored again.
+        bool split(node_vector_t<Node>& nodes,
+                   node_vector_t<Contents>& contents,
+                   vector_t<Index>& freeNodes,
+                   std::size_t index,
+                   vector_t<LocationPayload>& points,
+                   std::size_t& unusedSlots)
+        {
+            const std::size_t entries = contents[index].m_entries;
+            const Slots slots = contents[index].m_slots;
+            std::size_t leftEntries;
+            if (Layout::dimensionMajor)
+            {
+                points.clear();
+                for (std::size_t i = 0; i < entries; i++)
+                {
+                    points.push_back(m_points.take(slots, i));
+                }
+                typename vector_t<LocationPayload>::iterator middle;
+                const bool partitioned = partitionBucket(nodes[index], points.begin(), points.end(), middle);
+                for (std::size_t i = 0; !partitioned && i < entries; i++)
+                {
+                    m_points.store(slots, i, std::move(points[i]));
+                }
+                if (!partitioned)
+                {
+                    return false;
+                }
+                leftEntries = middle - points.begin();
+            }
+            else
+            {
+                const SlotIterator first(m_points, slots, 0);
+                SlotIterator middle;
+                if (!partitionBucket(nodes[index], first, first + entries, middle))
+                {
+                    return false;
+                }
+                leftEntries = middle - first;
+            }
+
+            // adding the children can move the other nodes, so they are only referred to after both are added
+            const std::size_t left = newNode(nodes, contents, freeNodes);
+            const std::size_t right = newNode(nodes, contents, freeNodes);
+            nodes[index].m_children = std::make_pair(left, right);
+            contents[index].m_slots = Slots();
+            Node* childNodes[] = {&nodes[left], &nodes[right]};
+            Contents* childContents[] = {&contents[left], &contents[right]};
+
+            // the points stay in the parent's slots, the left child gets the slots for the points before the partition
+            // and the right child those after them. Each child keeps free slots up to the next multiple of BucketSize
+            // if the parent has them, and the rest are left unused, so that a bucket which grew large before it was
+            // split doesn't leave all its free slots to its rightmost leaf.
+            const std::size_t rightEntries = entries - leftEntries;
+            auto roundUp = [](std::size_t count) { return (count + BucketSize - 1) / BucketSize * BucketSize; };
+            const std::size_t leftCapacity = std::min(roundUp(leftEntries), slots.capacity - rightEntries);
+            const std::size_t rightCapacity = std::min(roundUp(rightEntries), slots.capacity - leftCapacity);
+            childContents[0]->m_slots = Slots {slots.first, leftCapacity};
+            childContents[1]->m_slots = Slots {slots.first + leftCapacity, rightCapacity};
+            unusedSlots += slots.capacity - leftCapacity - rightCapacity;
+            if (Layout::dimensionMajor)
+            {
+                for (std::size_t i = 0; i < points.size(); i++)
+                {
+                    const std::size_t child = i < leftEntries ? 0 : 1;
+                    childNodes[child]->expandBounds(points[i].location);
+                    Contents& bucket = *childContents[child];
+                    m_points.store(bucket.m_slots, bucket.m_entries++, std::move(points[i]));
+                }
+                return true;
+            }
+
+            // the right points in the left child's free slots move past the others, as their order doesn't matter
+            const std::size_t moved = std::min(leftCapacity, entries);
+            for (std::size_t i = leftEntries, to = std::max(leftCapacity, entries); i < moved; i++, to++)
+            {
+                m_points.store(slots, to, m_points.take(slots, i));
+            }
+            childContents[0]->m_entries = Index(leftEntries);
+            childContents[1]->m_entries = Index(rightEntries);
+            for (std::size_t child = 0; child < 2; child++)
+            {
+                for (std::size_t i = 0; i < childContents[child]->m_entries; i++)
+                {
+                    childNodes[child]->expandBounds(m_points.location(childContents[child]->m_slots, i));
+                }
+            }
+            return true;
+        }
+
+        // Makes sure the bucket `index` has free slots for `count` more points. If it doesn't, it is moved to the end
+        // of m_points with at least twice as many slots, and its old slots are left unused until the points are
+        // repacked, which happens once more than a quarter of m_points is unused.
+        void reserveBucket(std::size_t index, std::size_t count)
+        {
+            Contents& bucket = m_contents[index];
+            if (bucket.m_entries + count <= bucket.m_slots.capacity)
+            {
+                return;
+            }
+
+            const std::size_t capacity = std::max<std::size_t>(bucket.m_entries + count, 2 * bucket.m_slots.capacity);
+            const Slots slots {m_points.size(), std::max(BucketSize, capacity)};
+            m_points.resize(slots.first + slots.capacity);
+            m_points.move(bucket.m_slots, m_points, slots, bucket.m_entries);
+            m_unusedSlots += bucket.m_slots.capacity;
+            bucket.m_slots = slots;
+            reclaimUnusedSlots();
+        }
+
+        // Repacks the points once more than a quarter of m_points is unused. Buckets split as points are added move
+        // to the end of m_points as soon as they grow, so with a laxer limit unused slots would outnumber the points.
+        void reclaimUnusedSlots()
+        {
+            if (m_unusedSlots > m_points.size() / 4)
+            {
+                repackPoints(false);
+            }
+        }
+
+        // Lays the buckets out in m_points again in depth first order, without unused slots between them. If `shrink`
+        // is set the buckets only keep the slots they need for their points, otherwise they keep their free slots.
+        void repackPoints(bool shrink)
+        {
+            PointStore points(get_allocator());
+            points.resize(shrink ? size() : m_points.size() - m_unusedSlots);
+            std::size_t first = 0;
+            std::vector<std::size_t> repackStack(1, 0);
+            while (repackStack.size() > 0)
+            {
+                const Node& node = m_nodes[repackStack.back()];
+                Contents& bucket = m_contents[repackStack.back()];
+                repackStack.pop_back();
+                if (node.m_splitDimension == Dimensions)
+                {
+                    const Slots slots {first, shrink ? bucket.m_entries : bucket.m_slots.capacity};
+                    m_points.move(bucket.m_slots, points, slots, bucket.m_entries);
+                    bucket.m_slots = slots;
+                    first += slots.capacity;
+                }
+                else
+                {
+                    repackStack.push_back(node.m_children.second);
+                    repackStack.push_back(node.m_children.first); // left is laid out first
+                }
+            }
+            std::swap(m_points, points);
+            m_unusedSlots = 0;
+        }
+
+        // returns the index of an empty node, reusing one left over from merging if possible. Adding a node can move
+        // the others, so references to nodes taken before don't stay valid.
+        static std::size_t
+        newNode(node_vector_t<Node>& nodes, node_vector_t<Contents>& contents, vector_t<Index>& freeNodes)
+        {
+            if (freeNodes.size() > 0)
+            {
+                std::size_t index = freeNodes.back();
+                freeNodes.pop_back();
+                return index;
+            }
+            nodes.emplace_back();
+            contents.emplace_back();
+            return nodes.size() - 1;
+        }
+
+        // Rebuilds the highest subtree on the way to `location` which has too many of its points in one child, after
+        // `added` points were added there. Subtrees are only rebuilt while there is enough credit from adding points to
+        // pay for it, so data that can't be balanced, like lots of duplicates, can't cause a rebuild on every addition.
+        void rebalance(const point_t& location, std::size_t added)
+        {
+            std::vector<std::size_t> path;
+            std::size_t node = 0;
+            while (m_nodes[node].m_splitDimension != Dimensions)
+            {
+                path.push_back(node);
+                if (location[m_nodes[node].m_splitDimension] < m_nodes[node].m_splitValue)
+                {
+                    node = m_nodes[node].m_children.first;
+                }
+                else
+                {
+                    node = m_nodes[node].m_children.second;
+                }
+            }
+
+            // each added point pays for rebuilding every subtree it is in, once that subtree has had enough points
+            // added to be unbalanced again since it was last rebuilt
+            m_rebuildCredit += double(added * path.size()) / (2 * m_maxImbalance - 1);
+            for (std::size_t index : path)
+            {
+                const Node& branch = m_nodes[index];
+                const std::size_t entries = m_contents[index].m_entries;
+                std::size_t largest = std::max(m_contents[branch.m_children.first].m_entries,
+                                               m_contents[branch.m_children.second].m_entries);
+                if (entries >= 4 * BucketSize && largest > m_maxImbalance * entries)
+                {
+                    if (entries <= m_rebuildCredit)
+                    {
+                        m_rebuildCredit -= entries;
+                        mergeSubtree(index);
+                        std::vector<Index> splitStack(1, index);
+                        splitRecursively(m_nodes, m_contents, m_freeNodes, splitStack, m_unusedSlots);
+                    }
+                    return;
+                }
+            }
+        }
+
+        // turns a branch back into a single leaf with all the points of its subtree, leaving the other nodes of the
+        // subtree free for reuse and no longer waiting to be split
+        void mergeSubtree(std::size_t index)
+        {
+            std::vector<LocationPayload> points;
+            points.reserve(m_contents[index].m_entries);
+            std::vector<std::size_t> mergeStack {m_nodes[index].m_children.first, m_nodes[index].m_children.second};
+            while (mergeStack.size() > 0)
+            {
+                std::size_t mergeNode = mergeStack.back();
+                mergeStack.pop_back();
+                Node& node = m_nodes[mergeNode];
+                Contents& bucket = m_contents[mergeNode];
+                if (node.m_splitDimension == Dimensions)
+                {
+                    for (std::size_t i = 0; i < bucket.m_entries; i++)
+                    {
+                        points.push_back(m_points.take(bucket.m_slots, i));
+                    }
+                    m_unusedSlots += bucket.m_slots.capacity;
+                }
+                else
+                {
+                    mergeStack.push_back(node.m_children.first);
+                    mergeStack.push_back(node.m_children.second);
+                }
+                node = Node();
+                bucket = Contents();
+                m_freeNodes.push_back(mergeNode);
+                waitingForSplit.erase(Index(mergeNode)); // before it is reused for another node
+            }
+
+            // the merged points go in new slots at the end, as the slots of the leaves aren't necessarily contiguous
+            Node& branch = m_nodes[index];
+            Contents& bucket = m_contents[index];
+            bucket.m_slots = Slots {m_points.size(), std::max(BucketSize, points.size())};
+            branch.m_splitDimension = Dimensions;
+            branch.m_splitValue = 0;
+            m_points.resize(bucket.m_slots.first + bucket.m_slots.capacity);
+            for (std::size_t i = 0; i < points.size(); i++)
+            {
+                m_points.store(bucket.m_slots, i, std::move(points[i]));
+            }
+        }
+
+        // returns the slot of the point with this location and payload in the bucket `node`, or m_entries if it isn't
+        // in the bucket
+        std::size_t findInBucket(const Contents& node, const point_t& location, const payload_t& payload) const
+        {
+            for (std::size_t i = 0; i < node.m_entries; i++)
+            {
+                if (m_points.location(node.m_slots, i) == location
+                    && m_points.payloads[node.m_slots.first + i] == payload)
+                {
+                    return i;
+                }
+            }
+            return node.m_entries;
+        }
+
+        // shrinks the bounds of the bucket `node` to fit its points
+        void shrinkBucketBounds(Node& node, const Contents& bucket) const
+        {
+            node.m_bounds = Node::emptyBounds();
+            for (std::size_t i = 0; i < bucket.m_entries; i++)
+            {
+                Node::expandBounds(node.m_bounds, m_points.location(bucket.m_slots, i));
+            }
+        }
+
+        struct Node
+        {
+            struct Range
+            {
+                BoundsScalar min, max;
+            };
+            using bounds_t = std::array<Range, Dimensions>;
+            using dimension_t = typename std::conditional<Dimensions < 256, std::uint8_t, std::size_t>::type;
+
+            Node() : m_bounds(emptyBounds()) { }
+
+            static bounds_t emptyBounds()
+            {
+                bounds_t bounds;
+                bounds.fill(
+                    Range {std::numeric_limits<BoundsScalar>::max(), std::numeric_limits<BoundsScalar>::lowest()});
+                return bounds;
+            }
+
+            // Bounds stored with less precision than the points are rounded outwards, so they always contain them.
+            // These give the closest BoundsScalar at or below, and at or above, `value`.
+            static BoundsScalar roundDown(Scalar value)
+            {
+                using limits = std::numeric_limits<BoundsScalar>;
+                if (value < Scalar(limits::lowest()))
+                {
+                    return -limits::infinity();
+                }
+                if (value > Scalar(limits::max()))
+                {
+                    return limits::max();
+                }
+                BoundsScalar rounded = BoundsScalar(value);
+                return Scalar(rounded) > value ? std::nextafter(rounded, -limits::infinity()) : rounded;
+            }
+
+            static BoundsScalar roundUp(Scalar value)
+            {
+                using limits = std::numeric_limits<BoundsScalar>;
+                if (value > Scalar(limits::max()))
+                {
+                    return limits::infinity();
+                }
+                if (value < Scalar(limits::lowest()))
+                {
+                    return limits::lowest();
+                }
+                BoundsScalar rounded = BoundsScalar(value);
+                return Scalar(rounded) < value ? std::nextafter(rounded, limits::infinity()) : rounded;
+            }
+
+            static void expandBounds(bounds_t& bounds, const point_t& location)
+            {
+                for (std::size_t i = 0; i < Dimensions; i++)
+                {
+                    if (bounds[i].min > location[i])
+                    {
+                        bounds[i].min = roundDown(location[i]);
+                    }
+                    if (bounds[i].max < location[i])
+                    {
+                        bounds[i].max = roundUp(location[i]);
+                    }
+                }
+            }
+
+            void expandBounds(const point_t& location) { expandBounds(m_bounds, location); }
+
+            // whether a point moving from `from` to `to` leaves an edge of the bounds in some dimension, after which
+            // they may be larger than needed
+            bool leavesEdge(const point_t& from, const point_t& to) const
+            {
+                for (std::size_t i = 0; i < Dimensions; i++)
+                {
+                    if ((to[i] > from[i] && roundDown(from[i]) <= m_bounds[i].min)
+                        || (to[i] < from[i] && roundUp(from[i]) >= m_bounds[i].max))
+                    {
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            void expandBounds(const bounds_t& bounds)
+            {
+                for (std::size_t i = 0; i < Dimensions; i++)
+                {
+                    m_bounds[i].min = std::min(m_bounds[i].min, bounds[i].min);
+                    m_bounds[i].max = std::max(m_bounds[i].max, bounds[i].max);
+                }
+            }
+
+            // fits the bounds to those of the children, returning whether they changed
+            bool shrinkBounds(const Node& leftNode, const Node& rightNode)
+            {
+                const bounds_t bounds = m_bounds;
+                m_bounds = leftNode.m_bounds;
+                for (std::size_t i = 0; i < Dimensions; i++)
+                {
+                    m_bounds[i].min = std::min(m_bounds[i].min, rightNode.m_bounds[i].min);
+                    m_bounds[i].max = std::max(m_bounds[i].max, rightNode.m_bounds[i].max);
+                }
+                return !sameBounds(bounds, m_bounds);
+            }
+
+            static bool sameBounds(const bounds_t& bounds1, const bounds_t& bounds2)
+            {
+                for (std::size_t i = 0; i < Dimensions; i++)
+                {
+                    if (bounds1[i].min != bounds2[i].min || bounds1[i].max != bounds2[i].max)
+                    {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            // queues the children of this node, whose points are at least `minDist` from `location`
+            void queueChildren(const point_t& location, Scalar minDist, SearchStack& searchStack) const
+            {
+                queueChildren(m_bounds,
+                              m_splitDimension,
+                              m_splitValue,
+                              m_children.first,
+                              m_children.second,
+                              location,
+                              minDist,
+                              searchStack);
+            }
+
+            // Queues the children of a branch with `bounds`, whose points are at least `minDist` from `location`, so
+            // that the child on the same side of the split as `location` is popped first. That child gets `minDist`
+            // as its bound, and the other one the bound from farChildDist().
+            static void queueChildren(const bounds_t& bounds,
+                                      std::size_t splitDimension,
+                                      Scalar splitValue,
+                                      Index left,
+                                      Index right,
+                                      const point_t& location,
+                                      Scalar minDist,
+                                      SearchStack& searchStack)
+            {
+                const Scalar farDist = farChildDist(bounds, splitDimension, splitValue, location, minDist);
+                if (location[splitDimension] < splitValue)
+                {
+                    searchStack.push(right, farDist);
+                    searchStack.push(left, minDist); // left is popped first
+                }
+                else
+                {
+                    searchStack.push(left, farDist);
+                    searchStack.push(right, minDist); // right is popped first
+                }
+            }
+
+            // A bound on the distance to the points on the other side of the split from `location`, found in O(1).
+            // They are at least as far from it as the split value in the split dimension. With a monotonic Distance
+            // that has coordinateDistance(), that term replaces the one for the split dimension in `minDist`, the
+            // distance to the bounds of the branch, as done by Arya and Mount. Swapping terms rounds differently from
+            // summing them in order, so the result is shrunk by more than the rounding error, to never prune a point
+            // which the distance to the bounds of the child would keep.
+            static Scalar farChildDist(const bounds_t& bounds,
+                                       std::size_t splitDimension,
+                                       Scalar splitValue,
+                                       const point_t& location,
+                                       Scalar minDist)
+            {
+                const bool decomposable
+                    = HasCoordinateDistance<Distance, Scalar>::value && IsMonotonic<Distance>::value;
+                return farChildDist(bounds,
+                                    splitDimension,
+                                    splitValue,
+                                    location,
+                                    minDist,
+                                    std::integral_constant<bool, decomposable>());
+            }
+
+            static Scalar
+            farChildDist(const bounds_t&, std::size_t, Scalar, const point_t&, Scalar minDist, std::false_type)
+            {
+                return minDist;
+            }
+
+            static Scalar farChildDist(const bounds_t& bounds,
+                                       std::size_t splitDimension,
+                                       Scalar splitValue,
+                                       const point_t& location,
+                                       Scalar minDist,
+                                       std::true_type)
+            {
+                const Scalar coordinate = location[splitDimension];
+                const Range& range = bounds[splitDimension];
+                const Scalar closest = std::max(Scalar(range.min), std::min(Scalar(range.max), coordinate));
+                const Scalar boundsTerm = Distance::coordinateDistance(closest, coordinate);
+                const Scalar splitTerm = Distance::coordinateDistance(splitValue, coordinate);
+                if (!(splitTerm > boundsTerm))
+                {
+                    return minDist;
+                }
+                const Scalar margin = Scalar(4 * Dimensions) * std::numeric_limits<Scalar>::epsilon();
+                return std::max(minDist, (minDist - boundsTerm + splitTerm) * (1 - margin));
+            }
+
+            Scalar pointRectDist(const point_t& location) const { return pointRectDist(m_bounds, location); }
+
+            static Scalar pointRectDist(const bounds_t& bounds, const point_t& location)
+            {
+                auto clamp = [](Scalar v, Range r) { return std::max(Scalar(r.min), std::min(Scalar(r.max), v)); };
+
+                point_t closestBoundsPoint;
+
+                for (std::size_t i = 0; i < Dimensions; i++)
+                {
+                    closestBoundsPoint[i] = clamp(location[i], bounds[i]);
+                }
+                return Distance::distance(closestBoundsPoint, location);
+            }
+
+            dimension_t m_splitDimension = Dimensions; /// split dimension of this node, or Dimensions for a leaf
+            Scalar m_splitValue = 0; /// split value of this node
+
+            bounds_t m_bounds; /// bounding box of this node
+
+            std::pair<Index, Index> m_children; /// subtrees of this node (if not a leaf)
+        };
+
+        // the parts of a node that are only needed when adding or removing points, or at the leaves, so they are kept
+        // out of the way of the traversal in m_contents, at the same index as the node in m_nodes
+        struct Contents
+        {
+            bool shouldSplit() const { return m_entries >= BucketSize; }
+
+            Index m_entries = 0; /// size of the tree, or subtree
+            Slots m_slots; /// slots in m_points holding the points of this node (if a leaf), live entries first
+        };
+    };
+
+    // A read-only copy of a KDTree, made by KDTree::freeze(), for trees which are searched for a long time after they
+    // are built. The nodes are laid out in depth first order, so the left child of a branch is the node after it and
+    // only the right child is stored, and a subtree is a contiguous range of nodes. The buckets are laid out in the
+    // same order without any free slots, and there is none of the bookkeeping needed for adding or removing points.
+    template <class Payload,
+              std::size_t Dimensions,
+              std::size_t BucketSize = 32,
+              class Distance = SquaredL2,
+              typename Scalar = double,
+              class SplitPolicy = MedianSplit,
+              class Layout = PointMajorLayout,
+              typename Index = std::size_t,
+              class Allocator = std::allocator<char>,
+              typename BoundsScalar = Scalar,
+              class NodeStorage = ContiguousNodes>
+    class FrozenKDTree
+    {
+    public:
+        using tree_t = KDTree<Payload,
+                              Dimensions,
+                              BucketSize,
+                              Distance,
+                              Scalar,
+                              SplitPolicy,
+                              Layout,
+                              Index,
+                              Allocator,
+                              BoundsScalar,
+                              NodeStorage>;
+        using frozen_t = FrozenKDTree<Payload,
+                                      Dimensions,
+                                      BucketSize,
+                                      Distance,
+                                      Scalar,
+                                      SplitPolicy,
+                                      Layout,
+                                      Index,
+                                      Allocator,
+                                      BoundsScalar,
+                                      NodeStorage>;
+        using distance_t = Distance;
+        using layout_t = Layout;
+        using index_t = Index;
+        using scalar_t = Scalar;
+        using payload_t = typename tree_t::payload_t;
+        using point_t = typename tree_t::point_t;
+        using DistancePayload = typename tree_t::DistancePayload;
+        using SearchStack = typename tree_t::SearchStack;
+        static const std::size_t dimensions = Dimensions;
+        static const std::size_t bucketSize = BucketSize;
+
+        explicit FrozenKDTree(const tree_t& tree)
+            : m_nodes(typename tree_t::template alloc_t<Node>(tree.get_allocator()))
+            , m_points(tree.get_allocator())
+            , m_size(tree.size())
+        {
+            m_nodes.reserve(tree.m_nodes.size() - tree.m_freeNodes.size());
+            m_points.resize(m_size);
+
+            // each node is added after its parent and left subtree, and its index is given to the parent if it is
+            // the right child
+            const std::size_t noParent = std::numeric_limits<std::size_t>::max();
+            std::vector<std::pair<std::size_t, std::size_t>> freezeStack {{0, noParent}}; // node and parent to tell
+            std::size_t first = 0;
+            while (freezeStack.size() > 0)
+            {
+                const std::size_t index = freezeStack.back().first;
+                const std::size_t parent = freezeStack.back().second;
+                freezeStack.pop_back();
+                const typename tree_t::Node& node = tree.m_nodes[index];
+                if (parent != noParent)
+                {
+                    m_nodes[parent].m_next = Index(m_nodes.size());
+                }
+
+                Node frozen;
+                frozen.m_bounds = node.m_bounds;
+                frozen.m_splitDimension = node.m_splitDimension;
+                frozen.m_splitValue = node.m_splitValue;
+                if (node.m_splitDimension == Dimensions)
+                {
+                    const typename tree_t::Contents& bucket = tree.m_contents[index];
+                    frozen.m_next = Index(first);
+                    frozen.m_entries = bucket.m_entries;
+                    tree.m_points.copy(bucket.m_slots, m_points, frozen.slots(), bucket.m_entries);
+                    first += bucket.m_entries;
+                }
+                else
+                {
+                    freezeStack.emplace_back(node.m_children.second, m_nodes.size());
+                    freezeStack.emplace_back(node.m_children.first, noParent);
+                }
+                m_nodes.push_back(frozen);
+            }
+        }
+
+        std::size_t size() const { return m_size; }
+
+        std::vector<DistancePayload> searchKnn(const point_t& location, std::size_t maxPoints) const
+        {
+            return searcher().search(location, std::numeric_limits<Scalar>::max(), maxPoints);
+        }
+
+        std::vector<DistancePayload> searchBall(const point_t& location, Scalar maxRadius) const
+        {
+            return searcher().search(location, maxRadius, std::numeric_limits<std::size_t>::max());
+        }
+
+        std::vector<DistancePayload> searchCapacityLimitedBall(const point_t& location,
+                                                               Scalar maxRadius,
+                                                               std::size_t maxPoints) const
+        {
+            return searcher().search(location, maxRadius, maxPoints);
+        }
+
+        DistancePayload search(const point_t& location) const
+        {
+            std::priority_queue<DistancePayload> prioqueue;
+            SearchStack searchStack;
+            std::vector<DistancePayload> results;
+            searchCapacityLimitedBall(location, std::numeric_limits<Scalar>::infinity(), 1, searchStack, prioqueue,
+                                      results);
+            if (results.empty())
+            {
+                DistancePayload result {};
+                result.distance = std::numeric_limits<Scalar>::infinity();
+                return result;
+            }
+            return results[0];
+        }
+
+        // see KDTree::memoryUsage(), a frozen tree has no free nodes or slots and nothing waiting to be split
+        typename tree_t::MemoryUsage memoryUsage() const
+        {
+            typename tree_t::MemoryUsage usage;
+            usage.nodes = m_nodes.size() * sizeof(Node);
+            usage.nodesReserved = m_nodes.capacity() * sizeof(Node);
+            usage.points = m_size * (Dimensions * sizeof(Scalar) + sizeof(payload_t));
+            usage.pointsReserved = m_points.coordinates.capacity() * sizeof(Scalar)
+                + m_points.payloads.capacity() * sizeof(payload_t);
+            usage.freeNodes = 0;
+            usage.waitingForSplit = 0;
+            return usage;
+        }
+
+        using Searcher = TreeSearcher<frozen_t>;
+        friend Searcher;
+
+        // NB! returned class has no const methods. Get one instance per thread!
+        Searcher searcher() const { return Searcher(*this); }
+
+    private:
+        using bounds_t = typename tree_t::Node::bounds_t;
+
+        struct Node
+        {
+            typename tree_t::Slots slots() const { return typename tree_t::Slots(m_next, m_entries); }
+
+            bounds_t m_bounds; /// bounding box of this node
+            Scalar m_splitValue = 0; /// split value of this node
+            Index m_next = 0; /// index of the right child of a branch, or the first slot of the points of a leaf
+            Index m_entries = 0; /// number of points in a leaf
+            typename tree_t::Node::dimension_t m_splitDimension = Dimensions; /// or Dimensions for a leaf
+        };
+
+        typename tree_t::template vector_t<Node> m_nodes;
+        typename tree_t::PointStore m_points;
+        std::size_t m_size;
+
+        std::size_t searchCapacityLimitedBall(const point_t& location,
+                                              Scalar maxRadius,
+                                              std::size_t maxPoints,
+                                              SearchStack& searchStack,
+                                              std::priority_queue<DistancePayload>& prioqueue,
+                                              std::vector<DistancePayload>& results) const
+        {
+            std::size_t visitedNodes = 0;
+            if (maxPoints == 0 || m_size == 0)
+            {
+                return visitedNodes;
+            }
+
+            auto mayBeCloser = [&](Scalar minDist) {
+                return maxRadius > minDist && (prioqueue.size() < maxPoints || prioqueue.top().distance > minDist);
+            };
+            searchStack.push(0, 0);
+            while (!searchStack.empty())
+            {
+                std::size_t nodeIndex;
+                Scalar minDist;
+                searchStack.pop(nodeIndex, minDist);
+                visitedNodes++;
+                if (!mayBeCloser(minDist)) // without looking at the bounds of the node
+                {
+                    continue;
+                }
+                const Node& node = m_nodes[nodeIndex];
+                minDist = tree_t::Node::pointRectDist(node.m_bounds, location);
+                if (mayBeCloser(minDist))
+                {
+                    if (node.m_splitDimension == Dimensions)
+                    {
+                        m_points.search(node.slots(), node.m_entries, location, maxRadius, maxPoints, prioqueue);
+                    }
+                    else
+                    {
+                        tree_t::Node::queueChildren(node.m_bounds,
+                                                    node.m_splitDimension,
+                                                    node.m_splitValue,
+                                                    Index(nodeIndex + 1),
+                                                    node.m_next,
+                                                    location,
+                                                    minDist,
+                                                    searchStack);
+                    }
+                }
+            }
+            tree_t::popResults(prioqueue, results);
+            return visitedNodes;
+        }
+    };
+
+    // A set of trees for when points are added much more often than they are queried, using the logarithmic method of
+    // Bentley and Saxe. New points are put in an unsplit buffer. When it is full, its points and those of the trees
+    // that are the same size are built into a tree twice as large, like carrying in a binary counter. Every tree is
+    // perfectly balanced and each point is only rebuilt O(log n) times. Queries search the trees from largest to
+    // smallest into one result queue, so the points found in the large trees prune the search of the small ones.
+    template <class Payload,
+              std::size_t Dimensions,
+              std::size_t BucketSize = 32,
+              class Distance = SquaredL2,
+              typename Scalar = double,
+              class SplitPolicy = MedianSplit,
+              class Layout = PointMajorLayout,
+              typename Index = std::size_t,
+              class Allocator = std::allocator<char>,
+              typename BoundsScalar = Scalar,
+              class NodeStorage = ContiguousNodes>
+    class KDForest
+    {
+    public:
+        using tree_t = KDTree<Payload,
+                              Dimensions,
+                              BucketSize,
+                              Distance,
+                              Scalar,
+                              SplitPolicy,
+                              Layout,
+                              Index,
+                              Allocator,
+                              BoundsScalar,
+                              NodeStorage>;
+        using point_t = typename tree_t::point_t;
+        using payload_t = typename tree_t::payload_t;
+        using DistancePayload = typename tree_t::DistancePayload;
+
+        // bufferSize is the number of points that are searched linearly before they are built into a tree
+        explicit KDForest(std::size_t bufferSize = 4 * BucketSize, const Allocator& allocator = Allocator())
+            : m_bufferSize(std::max<std::size_t>(1, bufferSize)), m_buffer(allocator)
+        {
+        }
+
+        std::size_t size() const
+        {
+            std::size_t entries = m_buffer.size();
+            for (const tree_t& tree : m_trees)
+            {
+                entries += tree.size();
+            }
+            return entries;
+        }
+
+        // the number of trees holding points, not counting the buffer
+        std::size_t treeCount() const
+        {
+            return std::count_if(m_trees.begin(), m_trees.end(), [](const tree_t& tree) { return tree.size() > 0; });
+        }
+
+        void addPoint(const point_t& location, const payload_t& payload)
+        {
+            m_buffer.addPoint(location, payload, false);
+            if (m_buffer.size() >= m_bufferSize)
+            {
+                std::vector<typename tree_t::LocationPayload> points;
+                m_buffer.extractPoints(points);
+                std::size_t level = 0;
+                for (; level < m_trees.size() && m_trees[level].size() > 0; level++)
+                {
+                    m_trees[level].extractPoints(points);
+                }
+                if (level == m_trees.size())
+                {
+                    m_trees.emplace_back(m_buffer.get_allocator());
+                }
+                m_trees[level].build(points);
+            }
+        }
+
+        std::vector<DistancePayload> searchKnn(const point_t& location, std::size_t maxPoints) const
+        {
+            return searchCapacityLimitedBall(location, std::numeric_limits<Scalar>::max(), maxPoints);
+        }
+
+        std::vector<DistancePayload> searchBall(const point_t& location, Scalar maxRadius) const
+        {
+            return searchCapacityLimitedBall(location, maxRadius, std::numeric_limits<std::size_t>::max());
+        }
+
+        std::vector<DistancePayload> searchCapacityLimitedBall(const point_t& location,
+                                                               Scalar maxRadius,
+                                                               std::size_t maxPoints) const
+        {
+            maxPoints = std::min(maxPoints, size());
+            typename tree_t::SearchStack searchStack;
+            std::priority_queue<DistancePayload> prioqueue;
+            for (auto tree = m_trees.rbegin(); tree != m_trees.rend(); ++tree)
+            {
+                tree->searchCapacityLimitedBall(location, maxRadius, maxPoints, searchStack, prioqueue);
+            }
+            m_buffer.searchCapacityLimitedBall(location, maxRadius, maxPoints, searchStack, prioqueue);
+
+            std::vector<DistancePayload> results;
+            tree_t::popResults(prioqueue, results);
+            return results;
+        }
+
+    private:
+        std::size_t m_bufferSize;
+        tree_t m_buffer; /// a single leaf holding the newest points
+        std::vector<tree_t> m_trees; /// m_trees[i] is either empty or holds bufferSize * 2^i points
+    };
+
+    // A tree of the points added in a sliding time window, for example the latest observations of a moving sensor.
+    // The window is divided into epochs, and the points of each epoch go in their own tree. Points expire together
+    // with their epoch, which is dropped as a whole without touching the other trees, so a point stays searchable for
+    // between `window` and `window + window / epochs` after it was added. Queries take the time they are made at, and
+    // search the trees of the epochs still live then into one result queue, even if expire() wasn't called since.
+    template <class Payload,
+              std::size_t Dimensions,
+              std::size_t BucketSize = 32,
+              class Distance = SquaredL2,
+              typename Scalar = double,
+              class SplitPolicy = MedianSplit,
+              class Layout = PointMajorLayout,
+              typename Index = std::size_t,
+              class Allocator = std::allocator<char>,
+              typename BoundsScalar = Scalar,
+              class NodeStorage = ContiguousNodes>
+    class KDWindow
+    {
+    public:
+        using tree_t = KDTree<Payload,
+                              Dimensions,
+                              BucketSize,
+                              Distance,
+                              Scalar,
+                              SplitPolicy,
+                              Layout,
+                              Index,
+                              Allocator,
+                              BoundsScalar,
+                              NodeStorage>;
+        using point_t = typename tree_t::point_t;
+        using payload_t = typename tree_t::payload_t;
+        using DistancePayload = typename tree_t::DistancePayload;
+
+        KDWindow(double window, std::size_t epochs = 8, const Allocator& allocator = Allocator())
+            : m_window(window), m_epochLength(window / std::max<std::size_t>(1, epochs)), m_allocator(allocator)
+        {
+        }
+
+        std::size_t size() const
+        {
+            std::size_t entries = 0;
+            for (const Epoch& epoch : m_epochs)
+            {
+                entries += epoch.tree.size();
+            }
+            return entries;
+        }
+
+        // the number of epochs holding points, at most epochs + 1
+        std::size_t epochCount() const { return m_epochs.size(); }
+
+        // see KDTree::setMaxImbalance(), applies to the trees of epochs started after this call
+        void setMaxImbalance(double maxImbalance) { m_maxImbalance = tree_t::clampMaxImbalance(maxImbalance); }
+
+        // Adds a point at `time`, which must not be earlier than the time of the previous point. Epochs that have
+        // fallen out of the window by then are expired first.
+        void addPoint(const point_t& location, const payload_t& payload, double time)
+        {
+            expire(time);
+            if (m_epochs.empty() || time >= m_epochs.back().start + m_epochLength)
+            {
+                m_epochs.push_back(Epoch {std::floor(time / m_epochLength) * m_epochLength, tree_t(m_allocator)});
+                m_epochs.back().tree.setMaxImbalance(m_maxImbalance);
+            }
+            m_epochs.back().tree.addPoint(location, payload);
+        }
+
+        // Drops the epochs that ended at least `window` before `now`. Costs O(1) per epoch dropped, plus freeing it.
+        void expire(double now)
+        {
+            while (m_epochs.size() > 0 && expired(m_epochs.front(), now))
+            {
+                m_epochs.pop_front();
+            }
+        }
+
+        std::vector<DistancePayload> searchKnn(const point_t& location, std::size_t maxPoints, double now) const
+        {
+            return searchCapacityLimitedBall(location, std::numeric_limits<Scalar>::max(), maxPoints, now);
+        }
+
+        std::vector<DistancePayload> searchBall(const point_t& location, Scalar maxRadius, double now) const
+        {
+            return searchCapacityLimitedBall(location, maxRadius, std::numeric_limits<std::size_t>::max(), now);
+        }
+
+        // searches the points of the epochs that haven't expired at `now`
+        std::vector<DistancePayload> searchCapacityLimitedBall(const point_t& location,
+                                                               Scalar maxRadius,
+                                                               std::size_t maxPoints,
+                                                               double now) const
+        {
+            maxPoints = std::min(maxPoints, size());
+            typename tree_t::SearchStack searchStack;
+            std::priority_queue<DistancePayload> prioqueue;
+            for (auto epoch = m_epochs.rbegin(); epoch != m_epochs.rend() && !expired(*epoch, now); ++epoch)
+            {
+                epoch->tree.searchCapacityLimitedBall(location, maxRadius, maxPoints, searchStack, prioqueue);
+            }
+
+            std::vector<DistancePayload> results;
+            tree_t::popResults(prioqueue, results);
+            return results;
+        }
+
+    private:
+        struct Epoch
+        {
+            double start;
+            tree_t tree;
+        };
+
+        bool expired(const Epoch& epoch, double now) const { return epoch.start + m_epochLength + m_window <= now; }
+
+        double m_window;
+        double m_epochLength;
+        double m_maxImbalance = 1;
+        Allocator m_allocator;
+        std::deque<Epoch> m_epochs; /// oldest first
+    };
+
+    // A tree for large payloads. The tree only stores the index of each point's payload, and the payloads are kept in
+    // a separate array, so splitting buckets and searching never copy a payload. Search results carry the index,
+    // which payload() turns back into the payload. The index of a payload doesn't change until its point is removed,
+    // after which it is reused for the next point added. The payloads are kept in chunks which never move, so
+    // references from payload() stay valid while points are added, and until the payload's point is removed. Index
+    // defaults to std::uint32_t, so trees of more than a billion points need a larger one.
+    template <class Payload,
+              std::size_t Dimensions,
+              std::size_t BucketSize = 32,
+              class Distance = SquaredL2,
+              typename Scalar = double,
+              class SplitPolicy = MedianSplit,
+              class Layout = PointMajorLayout,
+              typename Index = std::uint32_t,
+              class Allocator = std::allocator<char>,
+              typename BoundsScalar = Scalar,
+              class NodeStorage = ContiguousNodes>
+    class IndirectKDTree
+    {
+        static_assert(!std::is_void<Payload>::value, "A KDTree without payloads already only stores an index");
+
+    public:
+        using tree_t = KDTree<Index,
+                              Dimensions,
+                              BucketSize,
+                              Distance,
+                              Scalar,
+                              SplitPolicy,
+                              Layout,
+                              Index,
+                              Allocator,
+                              BoundsScalar,
+                              NodeStorage>;
+        using point_t = typename tree_t::point_t;
+        using payload_t = Payload;
+        using DistancePayload = typename tree_t::DistancePayload; /// with the index of the payload
+
+        IndirectKDTree() : IndirectKDTree(Allocator()) { }
+
+        explicit IndirectKDTree(const Allocator& allocator)
+            : m_tree(allocator)
+            , m_payloads(typename tree_t::template alloc_t<Payload>(allocator))
+            , m_freePayloads(typename tree_t::template alloc_t<Index>(allocator))
+        {
+        }
+
+        std::size_t size() const { return m_tree.size(); }
+
+        // the tree of payload indices, for the parts of the KDTree API which aren't forwarded here
+        const tree_t& tree() const { return m_tree; }
+
+        const Payload& payload(Index index) const { return m_payloads[index]; }
+        Payload& payload(Index index) { return m_payloads[index]; }
+
+        // Adds a point, returning the index its payload is stored at
+        Index addPoint(const point_t& location, const Payload& payload, bool autosplit = true)
+        {
+            Index index;
+            if (m_freePayloads.size() > 0)
+            {
+                index = m_freePayloads.back();
+                m_freePayloads.pop_back();
+                m_payloads[index] = payload;
+            }
+            else
+            {
+                index = Index(m_payloads.size());
+                m_payloads.push_back(payload);
+            }
+            m_tree.addPoint(location, index, autosplit);
+            return index;
+        }
+
+        // Removes the point with this location and payload index, see KDTree::removePoint()
+        bool removePoint(const point_t& location, Index index, bool shrinkBounds = false)
+        {
+            if (!m_tree.removePoint(location, index, shrinkBounds))
+            {
+                return false;
+            }
+            m_payloads[index] = Payload();
+            m_freePayloads.push_back(index);
+            return true;
+        }
+
+        bool updatePoint(const point_t& oldLocation, const point_t& newLocation, Index index)
+        {
+            return m_tree.updatePoint(oldLocation, newLocation, index);
+        }
+
+        void splitOutstanding() { m_tree.splitOutstanding(); }
+        void splitOutstanding(std::size_t threads) { m_tree.splitOutstanding(threads); }
+        void setMaxImbalance(double maxImbalance) { m_tree.setMaxImbalance(maxImbalance); }
+
+        // compacts the tree, the payloads keep their indices
+        void compact() { m_tree.compact(); }
+
+        std::vector<DistancePayload> searchKnn(const point_t& location, std::size_t maxPoints) const
+        {
+            return m_tree.searchKnn(location, maxPoints);
+        }
+
+        std::vector<DistancePayload> searchBall(const point_t& location, Scalar maxRadius) const
+        {
+            return m_tree.searchBall(location, maxRadius);
+        }
+
+        std::vector<DistancePayload> searchCapacityLimitedBall(const point_t& location,
+                                                               Scalar maxRadius,
+                                                               std::size_t maxPoints) const
+        {
+            return m_tree.searchCapacityLimitedBall(location, maxRadius, maxPoints);
+        }
+
+        DistancePayload search(const point_t& location) const { return m_tree.search(location); }
+
+        // NB! returned class has no const methods. Get one instance per thread!
+        typename tree_t::Searcher searcher() const { return m_tree.searcher(); }
+
+    private:
+        using payload_vector_t = ChunkedVector<Payload, typename tree_t::template alloc_t<Payload>, 256>;
+
+        tree_t m_tree;
+        payload_vector_t m_payloads; /// indexed by the payloads of m_tree
+        typename tree_t::template vector_t<Index> m_freePayloads; /// indices of m_payloads not in use
     };
 }
 }
@@ -1,5 +1,6 @@
 #include <KDTree.h>
 
+#include <atomic>
 #include <cstdlib>
 #include <ctime>
 #include <iostream>
@@ -8,6 +9,26 @@ double drand() { return (rand() / (RAND_MAX + 1.)); }
 void example();
 void accuracyTest();
 void duplicateTest();
+void parallelSplitTest();
+void bulkBuildTest();
+void batchAddTest();
+void splitPolicyTest();
+void removalTest();
+void updateTest();
+void rebalanceTest();
+void forestTest();
+void windowTest();
+void layoutTest();
+void indexTest();
+void frozenTest();
+void allocatorTest();
+void indirectTest();
+void memoryTest();
+void boundsTest();
+void noPayloadTest();
+void chunkedTest();
+void splitMemoryTest();
+void scanTest();
 void performanceTest();
 
 int main()
@@ -15,6 +36,26 @@ int main()
     example();
     accuracyTest();
     duplicateTest();
+    parallelSplitTest();
+    bulkBuildTest();
+    batchAddTest();
+    splitPolicyTest();
+    removalTest();
+    updateTest();
+    rebalanceTest();
+    forestTest();
+    windowTest();
+    layoutTest();
+    indexTest();
+    frozenTest();
+    allocatorTest();
+    indirectTest();
+    memoryTest();
+    boundsTest();
+    noPayloadTest();
+    chunkedTest();
+    splitMemoryTest();
+    scanTest();
     performanceTest();
     return 0;
 }
@@ -260,6 +301,1690 @@ void duplicateTest()
 
 }
 
+void parallelSplitTest()
+{
+    std::cout << "Parallel split tests started" << std::endl;
+
+    // GIVEN: two trees with the same unsplit points, one split serially and the other on several threads
+    static const int dims = 3;
+    auto randomPoint = []() {
+        std::array<double, dims> loc;
+        for (std::size_t j = 0; j < dims; j++)
+        {
+            loc[j] = drand();
+        }
+        return loc;
+    };
+    using tree_t = jk::tree::KDTree<int, dims, 8>;
+    tree_t serialTree;
+    tree_t parallelTree;
+    for (int i = 0; i < 20000; i++)
+    {
+        const std::array<double, dims> loc = randomPoint();
+        serialTree.addPoint(loc, i, false);
+        parallelTree.addPoint(loc, i, false);
+    }
+
+    // WHEN: the trees are split
+    serialTree.splitOutstanding();
+    parallelTree.splitOutstanding(4);
+
+    // THEN: they should give the same results
+    if (serialTree.size() != parallelTree.size())
+    {
+        std::cout << "Count doesn't match!!!" << std::endl;
+    }
+    for (int i = 0; i < 2000; i++)
+    {
+        const std::array<double, dims> loc = randomPoint();
+        auto snn = serialTree.searchKnn(loc, 10);
+        auto pnn = parallelTree.searchKnn(loc, 10);
+        if (snn.size() != pnn.size())
+        {
+            std::cout << "Parallel split tree results are not the same size as serial tree results" << std::endl;
+            continue;
+        }
+        for (std::size_t j = 0; j < snn.size(); j++)
+        {
+            if (snn[j].distance != pnn[j].distance || snn[j].payload != pnn[j].payload)
+            {
+                std::cout << "Parallel split tree results not equal" << std::endl;
+            }
+        }
+        if (parallelTree.search(loc).payload != snn[0].payload)
+        {
+            std::cout << "1nn payloads not equal" << std::endl;
+        }
+    }
+    std::cout << "Parallel split tests completed" << std::endl;
+}
+
+void bulkBuildTest()
+{
+    std::cout << "Bulk build tests started" << std::endl;
+
+    // GIVEN: a bunch of points, some of them duplicates
+    static const int dims = 3;
+    auto randomPoint = []() {
+        std::array<double, dims> loc;
+        for (std::size_t j = 0; j < dims; j++)
+        {
+            loc[j] = drand();
+        }
+        return loc;
+    };
+    using tree_t = jk::tree::KDTree<int, dims, 8>;
+    std::vector<std::pair<tree_t::point_t, int>> points;
+    for (int i = 0; i < 20000; i++)
+    {
+        points.emplace_back(i % 10 == 1 && i > 1 ? points[1].first : randomPoint(), i);
+    }
+
+    // WHEN: one tree is built from all of them at once, and another by adding and splitting
+    tree_t builtTree(points.begin(), points.end());
+    tree_t addedTree;
+    for (const auto& p : points)
+    {
+        addedTree.addPoint(p.first, p.second, false);
+    }
+    addedTree.splitOutstanding();
+
+    // THEN: they should give the same results
+    if (builtTree.size() != points.size())
+    {
+        std::cout << "Count doesn't match!!!" << std::endl;
+    }
+    for (int i = 0; i < 2000; i++)
+    {
+        const std::array<double, dims> loc = randomPoint();
+        auto bnn = builtTree.searchKnn(loc, 10);
+        auto ann = addedTree.searchKnn(loc, 10);
+        if (bnn.size() != ann.size())
+        {
+            std::cout << "Built tree results are not the same size as added tree results" << std::endl;
+            continue;
+        }
+        for (std::size_t j = 0; j < bnn.size(); j++)
+        {
+            if (bnn[j].distance != ann[j].distance)
+            {
+                std::cout << "Built tree results not equal" << std::endl;
+            }
+        }
+    }
+
+    // AND: the built tree should still take new points
+    builtTree.addPoint(randomPoint(), -1);
+    if (builtTree.size() != points.size() + 1)
+    {
+        std::cout << "Count doesn't match!!!" << std::endl;
+    }
+    std::cout << "Bulk build tests completed" << std::endl;
+}
+
+void batchAddTest()
+{
+    std::cout << "Batch add tests started" << std::endl;
+
+    // GIVEN: a tree that already has some points in it, and batches of new points
+    static const int dims = 3;
+    auto randomPoint = []() {
+        std::array<double, dims> loc;
+        for (std::size_t j = 0; j < dims; j++)
+        {
+            loc[j] = drand();
+        }
+        return loc;
+    };
+    using tree_t = jk::tree::KDTree<int, dims, 8>;
+    std::vector<std::pair<tree_t::point_t, int>> points;
+    tree_t tree;
+    tree_t unsplitTree;
+    for (int i = 0; i < 1000; i++)
+    {
+        points.emplace_back(randomPoint(), i);
+        tree.addPoint(points.back().first, i);
+        unsplitTree.addPoint(points.back().first, i);
+    }
+
+    // WHEN: the batches are added, to one tree splitting as it goes and to the other splitting at the end
+    for (int batch = 0; batch < 20; batch++)
+    {
+        std::size_t batchStart = points.size();
+        for (int i = 0; i < 1000; i++)
+        {
+            points.emplace_back(randomPoint(), points.size());
+        }
+        tree.addPoints(points.begin() + batchStart, points.end());
+        unsplitTree.addPoints(points.begin() + batchStart, points.end(), false);
+    }
+    unsplitTree.splitOutstanding();
+
+    // THEN: both should give the same results as brute force
+    if (tree.size() != points.size() || unsplitTree.size() != points.size())
+    {
+        std::cout << "Count doesn't match!!!" << std::endl;
+    }
+    for (int i = 0; i < 200; i++)
+    {
+        const std::array<double, dims> loc = randomPoint();
+        std::vector<std::pair<double, int>> bnn;
+        for (const auto& p : points)
+        {
+            bnn.emplace_back(tree_t::distance_t::distance(loc, p.first), p.second);
+        }
+        std::sort(bnn.begin(), bnn.end());
+        for (const tree_t* t : {&tree, &unsplitTree})
+        {
+            auto tnn = t->searchKnn(loc, 10);
+            if (tnn.size() != 10)
+            {
+                std::cout << "Searched for 10, found " << tnn.size() << std::endl;
+                continue;
+            }
+            for (std::size_t j = 0; j < tnn.size(); j++)
+            {
+                if (bnn[j].first != tnn[j].distance || bnn[j].second != tnn[j].payload)
+                {
+                    std::cout << "Batch added tree results not equal" << std::endl;
+                }
+            }
+        }
+    }
+    std::cout << "Batch add tests completed" << std::endl;
+}
+
+template <class Tree>
+void splitPolicyBenchmark(const char* name,
+                          const std::vector<std::pair<typename Tree::point_t, int>>& points,
+                          const std::vector<typename Tree::point_t>& searchPoints,
+                          std::vector<double>& kthDistances)
+{
+    const std::size_t k = 8;
+    std::clock_t start = std::clock();
+    Tree tree(points.begin(), points.end());
+    std::clock_t built = std::clock();
+
+    auto searcher = tree.searcher();
+    std::size_t visitedNodes = 0;
+    for (std::size_t i = 0; i < searchPoints.size(); i++)
+    {
+        const auto& nn = searcher.search(searchPoints[i], std::numeric_limits<double>::max(), k);
+        visitedNodes += searcher.visitedNodes();
+
+        // every policy should find the same neighbours
+        if (kthDistances.size() == i)
+        {
+            kthDistances.push_back(nn.back().distance);
+        }
+        if (nn.size() != k || nn.back().distance != kthDistances[i])
+        {
+            std::cout << name << " split results not equal" << std::endl;
+        }
+    }
+    std::clock_t searched = std::clock();
+
+    std::cout << name << " split: building " << double(built - start) / CLOCKS_PER_SEC << "s, searching "
+              << double(searched - built) / CLOCKS_PER_SEC << "s, " << double(visitedNodes) / searchPoints.size()
+              << " nodes visited per query" << std::endl;
+}
+
+void splitPolicyTest()
+{
+    std::cout << "Split policy tests starting..." << std::endl;
+
+    // GIVEN: clustered data like a LiDAR scan, with points on small surface patches and lots of empty space
+    static const int dims = 3;
+    using point_t = std::array<double, dims>;
+    std::vector<std::pair<point_t, int>> points;
+    for (int patch = 0; patch < 200; patch++)
+    {
+        point_t centre, u, v;
+        for (std::size_t j = 0; j < dims; j++)
+        {
+            centre[j] = drand();
+            u[j] = 0.05 * (drand() - 0.5);
+            v[j] = 0.05 * (drand() - 0.5);
+        }
+        for (int i = 0; i < 1000; i++)
+        {
+            const double a = drand(), b = drand();
+            point_t loc;
+            for (std::size_t j = 0; j < dims; j++)
+            {
+                loc[j] = centre[j] + a * u[j] + b * v[j] + 0.0001 * drand();
+            }
+            points.emplace_back(loc, points.size());
+        }
+    }
+    std::vector<point_t> searchPoints;
+    for (int i = 0; i < 20000; i++)
+    {
+        point_t loc = points[std::size_t(drand() * points.size())].first;
+        for (std::size_t j = 0; j < dims; j++)
+        {
+            loc[j] += 0.01 * (drand() - 0.5);
+        }
+        searchPoints.push_back(loc);
+    }
+
+    // WHEN: trees are built with each split policy and searched
+    // THEN: the results should be the same, but the number of nodes visited will differ
+    std::vector<double> kthDistances;
+    using namespace jk::tree;
+    splitPolicyBenchmark<KDTree<int, dims, 16, SquaredL2, double, MedianSplit>>(
+        "median", points, searchPoints, kthDistances);
+    splitPolicyBenchmark<KDTree<int, dims, 16, SquaredL2, double, SlidingMidpointSplit>>(
+        "sliding midpoint", points, searchPoints, kthDistances);
+    splitPolicyBenchmark<KDTree<int, dims, 16, SquaredL2, double, SurfaceAreaSplit>>(
+        "surface area", points, searchPoints, kthDistances);
+
+    std::cout << "Split policy tests completed" << std::endl;
+}
+
+void removalTest()
+{
+    std::cout << "Removal tests started" << std::endl;
+
+    // GIVEN: a tree with a bunch of points, some of them duplicates
+    static const int dims = 3;
+    auto randomPoint = []() {
+        std::array<double, dims> loc;
+        for (std::size_t j = 0; j < dims; j++)
+        {
+            loc[j] = drand();
+        }
+        return loc;
+    };
+    using tree_t = jk::tree::KDTree<int, dims, 8>;
+    std::vector<std::pair<tree_t::point_t, int>> points;
+    tree_t tree;
+    for (int i = 0; i < 10000; i++)
+    {
+        points.emplace_back(i % 10 == 1 && i > 1 ? points[1].first : randomPoint(), i);
+        tree.addPoint(points.back().first, i, i % 2 == 0);
+    }
+    tree.splitOutstanding();
+
+    auto checkAgainstBruteForce = [&]() {
+        if (tree.size() != points.size())
+        {
+            std::cout << "Count doesn't match!!!" << std::endl;
+        }
+        for (int i = 0; i < 100; i++)
+        {
+            const std::array<double, dims> loc = randomPoint();
+            std::vector<std::pair<double, int>> bnn;
+            for (const auto& p : points)
+            {
+                bnn.emplace_back(tree_t::distance_t::distance(loc, p.first), p.second);
+            }
+            std::sort(bnn.begin(), bnn.end());
+            auto tnn = tree.searchKnn(loc, 10);
+            if (tnn.size() != std::min<std::size_t>(10, bnn.size()))
+            {
+                std::cout << "Searched for 10, found " << tnn.size() << std::endl;
+                continue;
+            }
+            for (std::size_t j = 0; j < tnn.size(); j++)
+            {
+                if (bnn[j].first != tnn[j].distance)
+                {
+                    std::cout << "Removal tree results not equal" << std::endl;
+                }
+            }
+            if (tnn.size() > 0 && tree.search(loc).distance != bnn[0].first)
+            {
+                std::cout << "1nn distances not equal" << std::endl;
+            }
+        }
+    };
+
+    // WHEN: most of the points are removed, in a random order
+    std::random_shuffle(points.begin(), points.end());
+    for (int i = 0; i < 9000; i++)
+    {
+        if (!tree.removePoint(points.back().first, points.back().second, i % 3 == 0))
+        {
+            std::cout << "Couldn't remove point" << std::endl;
+        }
+        points.pop_back();
+    }
+
+    // THEN: removing them again should fail, and the rest should still be found
+    if (tree.removePoint(points[0].first, -1))
+    {
+        std::cout << "Removed a point that isn't there" << std::endl;
+    }
+    checkAgainstBruteForce();
+
+    // WHEN: the tree is compacted, and then more points are added and removed
+    tree.compact();
+    checkAgainstBruteForce();
+    for (int i = 0; i < 5000; i++)
+    {
+        points.emplace_back(randomPoint(), 10000 + i);
+        if (i < 2500)
+        {
+            tree.addPoint(points.back().first, points.back().second);
+        }
+    }
+    for (int i = 0; i < 2000; i++)
+    {
+        tree.removePoint(points[i].first, points[i].second);
+    }
+    tree.addPoints(points.end() - 2500, points.end());
+    points.erase(points.begin(), points.begin() + 2000);
+
+    // THEN: it should still find the right points
+    checkAgainstBruteForce();
+
+    // AND: removing everything should leave an empty tree
+    for (const auto& p : points)
+    {
+        tree.removePoint(p.first, p.second);
+    }
+    points.clear();
+    tree.compact();
+    checkAgainstBruteForce();
+
+    // WHEN: points are removed from buckets still waiting to be split, merging them, and then more points are added
+    // and the tree is split on several threads
+    for (int i = 0; i < 10000; i++)
+    {
+        points.emplace_back(randomPoint(), i);
+        tree.addPoint(points.back().first, i, i < 8000);
+    }
+    std::random_shuffle(points.begin(), points.end());
+    for (int i = 0; i < 9500; i++)
+    {
+        tree.removePoint(points.back().first, points.back().second);
+        points.pop_back();
+    }
+    for (int i = 0; i < 10000; i++)
+    {
+        points.emplace_back(randomPoint(), 20000 + i);
+        tree.addPoint(points.back().first, points.back().second, i % 2 == 0);
+    }
+    tree.splitOutstanding(4);
+
+    // THEN: every point should be found once
+    checkAgainstBruteForce();
+    std::cout << "Removal tests completed" << std::endl;
+}
+
+void updateTest()
+{
+    std::cout << "Update tests started" << std::endl;
+
+    // GIVEN: a tree with a bunch of agents in it
+    static const int dims = 2;
+    auto randomPoint = []() {
+        std::array<double, dims> loc;
+        for (std::size_t j = 0; j < dims; j++)
+        {
+            loc[j] = drand();
+        }
+        return loc;
+    };
+    using tree_t = jk::tree::KDTree<int, dims, 8>;
+    std::vector<tree_t::point_t> agents;
+    tree_t tree;
+    for (int i = 0; i < 5000; i++)
+    {
+        agents.push_back(randomPoint());
+        tree.addPoint(agents.back(), i);
+    }
+
+    // WHEN: they move around a little every tick, and some of them jump somewhere else entirely
+    for (int tick = 0; tick < 20; tick++)
+    {
+        for (std::size_t i = 0; i < agents.size(); i++)
+        {
+            tree_t::point_t moved = agents[i];
+            if (drand() < 0.01)
+            {
+                moved = randomPoint();
+            }
+            else
+            {
+                for (std::size_t j = 0; j < dims; j++)
+                {
+                    moved[j] += 0.002 * (drand() - 0.5);
+                }
+            }
+            if (!tree.updatePoint(agents[i], moved, int(i)))
+            {
+                std::cout << "Couldn't update point" << std::endl;
+            }
+            agents[i] = moved;
+        }
+    }
+
+    // THEN: moving an agent that isn't there should fail, and searches should find the agents where they are now
+    if (tree.updatePoint(randomPoint(), randomPoint(), 0))
+    {
+        std::cout << "Updated a point that isn't there" << std::endl;
+    }
+    if (tree.size() != agents.size())
+    {
+        std::cout << "Count doesn't match!!!" << std::endl;
+    }
+    for (int i = 0; i < 200; i++)
+    {
+        const std::array<double, dims> loc = randomPoint();
+        std::vector<std::pair<double, int>> bnn;
+        for (std::size_t j = 0; j < agents.size(); j++)
+        {
+            bnn.emplace_back(tree_t::distance_t::distance(loc, agents[j]), j);
+        }
+        std::sort(bnn.begin(), bnn.end());
+        auto tnn = tree.searchKnn(loc, 10);
+        for (std::size_t j = 0; j < tnn.size(); j++)
+        {
+            if (bnn[j].first != tnn[j].distance || bnn[j].second != tnn[j].payload)
+            {
+                std::cout << "Updated tree results not equal" << std::endl;
+            }
+        }
+    }
+
+    // WHEN: the agents all drift one way and then back again
+    for (int tick = 0; tick < 40; tick++)
+    {
+        for (std::size_t i = 0; i < agents.size(); i++)
+        {
+            tree_t::point_t moved = agents[i];
+            moved[0] += tick < 20 ? 0.05 : -0.05;
+            tree.updatePoint(agents[i], moved, int(i));
+            agents[i] = moved;
+        }
+    }
+
+    // THEN: the bounds should have shrunk behind them, so searching where they were on the way visits about as many
+    // nodes as after compacting
+    tree_t compacted = tree;
+    compacted.compact();
+    auto searcher = tree.searcher();
+    auto compactedSearcher = compacted.searcher();
+    std::size_t visitedNodes = 0;
+    std::size_t compactedVisitedNodes = 0;
+    for (int i = 0; i < 1000; i++)
+    {
+        const std::array<double, dims> loc {{1.5 + drand(), drand()}};
+        searcher.search(loc, 0.01, 1);
+        visitedNodes += searcher.visitedNodes();
+        compactedSearcher.search(loc, 0.01, 1);
+        compactedVisitedNodes += compactedSearcher.visitedNodes();
+    }
+    if (visitedNodes > 2 * compactedVisitedNodes)
+    {
+        std::cout << "Updated tree bounds too large: " << visitedNodes << " nodes visited, " << compactedVisitedNodes
+                  << " when compacted" << std::endl;
+    }
+    std::cout << "Update tests completed" << std::endl;
+}
+
+void rebalanceTest()
+{
+    std::cout << "Rebalance tests starting..." << std::endl;
+
+    // GIVEN: points arriving in order along a path, which gives a badly balanced tree when split as they are added
+    static const int dims = 2;
+    using tree_t = jk::tree::KDTree<int, dims, 8>;
+    std::vector<std::pair<tree_t::point_t, int>> points;
+    for (int i = 0; i < 50000; i++)
+    {
+        points.emplace_back(tree_t::point_t {{i / 50000.0 + 0.001 * drand(), drand()}}, i);
+    }
+    std::vector<tree_t::point_t> searchPoints;
+    for (int i = 0; i < 20000; i++)
+    {
+        searchPoints.push_back(tree_t::point_t {{drand(), drand()}});
+    }
+
+    // WHEN: the points are added one at a time or in batches with rebalancing, or all at once
+    tree_t unbalancedTree;
+    tree_t rebalancedTree;
+    tree_t batchRebalancedTree;
+    tree_t tightlyRebalancedTree;
+    rebalancedTree.setMaxImbalance(0.6);
+    batchRebalancedTree.setMaxImbalance(0.6);
+    tightlyRebalancedTree.setMaxImbalance(0.5); // clamped, as rebuilding to perfect balance would never be paid for
+    for (const auto& p : points)
+    {
+        unbalancedTree.addPoint(p.first, p.second);
+        rebalancedTree.addPoint(p.first, p.second);
+        tightlyRebalancedTree.addPoint(p.first, p.second);
+    }
+    for (std::size_t i = 0; i < points.size(); i += 1000)
+    {
+        batchRebalancedTree.addPoints(points.begin() + i, points.begin() + i + 1000);
+    }
+    tree_t staticTree(points.begin(), points.end());
+
+    // THEN: the rebalanced trees should find the same points while visiting about as many nodes as the static tree
+    std::vector<std::pair<const char*, const tree_t*>> trees {{"unbalanced", &unbalancedTree},
+                                                              {"rebalanced", &rebalancedTree},
+                                                              {"batch rebalanced", &batchRebalancedTree},
+                                                              {"tightly rebalanced", &tightlyRebalancedTree},
+                                                              {"static", &staticTree}};
+    for (const auto& t : trees)
+    {
+        if (t.second->size() != points.size())
+        {
+            std::cout << "Count doesn't match!!!" << std::endl;
+        }
+        auto searcher = t.second->searcher();
+        auto staticSearcher = staticTree.searcher();
+        std::size_t visitedNodes = 0;
+        for (const auto& loc : searchPoints)
+        {
+            const auto nn = searcher.search(loc, std::numeric_limits<double>::max(), 3);
+            visitedNodes += searcher.visitedNodes();
+            const auto& snn = staticSearcher.search(loc, std::numeric_limits<double>::max(), 3);
+            for (std::size_t j = 0; j < snn.size(); j++)
+            {
+                if (nn[j].distance != snn[j].distance || nn[j].payload != snn[j].payload)
+                {
+                    std::cout << t.first << " tree results not equal" << std::endl;
+                }
+            }
+        }
+        std::cout << t.first << " tree: " << double(visitedNodes) / searchPoints.size()
+                  << " nodes visited per query" << std::endl;
+    }
+    std::cout << "Rebalance tests completed" << std::endl;
+}
+
+void forestTest()
+{
+    std::cout << "Forest tests started" << std::endl;
+
+    // GIVEN: a forest and a tree that points are added to one at a time, with searches in between
+    static const int dims = 3;
+    using forest_t = jk::tree::KDForest<int, dims, 8>;
+    using tree_t = forest_t::tree_t;
+    forest_t forest;
+    tree_t tree;
+    auto randomPoint = []() {
+        tree_t::point_t loc;
+        for (std::size_t j = 0; j < dims; j++)
+        {
+            loc[j] = drand();
+        }
+        return loc;
+    };
+
+    for (int i = 0; i < 20000; i++)
+    {
+        // WHEN: some of the points are duplicates
+        const auto loc = i % 10 == 1 ? tree_t::point_t {{0.5, 0.5, 0.5}} : randomPoint();
+        forest.addPoint(loc, i);
+        tree.addPoint(loc, i);
+
+        // THEN: the forest should find the same points as the tree at any time
+        if (i % 97 == 0)
+        {
+            const auto searchLoc = randomPoint();
+            const auto nn = forest.searchKnn(searchLoc, 10);
+            const auto tnn = tree.searchKnn(searchLoc, 10);
+            const auto ball = forest.searchBall(searchLoc, 0.01);
+            const auto tball = tree.searchBall(searchLoc, 0.01);
+            const auto limited = forest.searchCapacityLimitedBall(searchLoc, 0.01, 5);
+            const auto tlimited = tree.searchCapacityLimitedBall(searchLoc, 0.01, 5);
+            if (nn.size() != tnn.size() || ball.size() != tball.size() || limited.size() != tlimited.size())
+            {
+                std::cout << "Forest result sizes not equal" << std::endl;
+                continue;
+            }
+            for (std::size_t j = 0; j < nn.size(); j++)
+            {
+                if (nn[j].distance != tnn[j].distance)
+                {
+                    std::cout << "Forest KNN results not equal" << std::endl;
+                }
+            }
+            for (std::size_t j = 0; j < limited.size(); j++)
+            {
+                if (limited[j].distance != tlimited[j].distance)
+                {
+                    std::cout << "Forest capacity limited ball results not equal" << std::endl;
+                }
+            }
+        }
+    }
+
+    // THEN: it should hold all the points in a logarithmic number of trees
+    if (forest.size() != tree.size())
+    {
+        std::cout << "Count doesn't match!!!" << std::endl;
+    }
+    if (forest.treeCount() > 8)
+    {
+        std::cout << "Forest has too many trees: " << forest.treeCount() << std::endl;
+    }
+    std::cout << "Forest tests completed" << std::endl;
+}
+
+void windowTest()
+{
+    std::cout << "Window tests started" << std::endl;
+
+    // GIVEN: a window of 10 seconds in 8 epochs, and points added over 100 seconds
+    static const int dims = 3;
+    using window_t = jk::tree::KDWindow<int, dims, 8>;
+    using point_t = window_t::point_t;
+    const double window = 10;
+    const double epochLength = window / 8;
+    window_t tree(window, 8);
+    std::vector<std::pair<point_t, double>> points;
+    auto randomPoint = []() {
+        point_t loc;
+        for (std::size_t j = 0; j < dims; j++)
+        {
+            loc[j] = drand();
+        }
+        return loc;
+    };
+
+    for (int i = 0; i < 10000; i++)
+    {
+        // WHEN: a point is added
+        const double now = i * 0.01;
+        points.emplace_back(randomPoint(), now);
+        tree.addPoint(points.back().first, i, now);
+
+        // THEN: only the points of epochs that ended less than a window ago should be found
+        if (i % 53 == 0)
+        {
+            const auto searchLoc = randomPoint();
+            std::vector<std::pair<double, int>> live;
+            for (std::size_t j = 0; j < points.size(); j++)
+            {
+                if (std::floor(points[j].second / epochLength) * epochLength + epochLength + window > now)
+                {
+                    live.emplace_back(window_t::tree_t::distance_t::distance(searchLoc, points[j].first), j);
+                }
+            }
+            std::sort(live.begin(), live.end());
+            if (tree.size() != live.size() || tree.epochCount() > 9)
+            {
+                std::cout << "Window holds the wrong points: " << tree.size() << " vs " << live.size() << std::endl;
+            }
+
+            const auto nn = tree.searchKnn(searchLoc, 10, now);
+            for (std::size_t j = 0; j < nn.size(); j++)
+            {
+                if (nn[j].distance != live[j].first || nn[j].payload != live[j].second)
+                {
+                    std::cout << "Window KNN results not equal" << std::endl;
+                }
+            }
+            const auto ball = tree.searchBall(searchLoc, 0.01, now);
+            if (ball.size() != std::size_t(std::lower_bound(live.begin(), live.end(), std::make_pair(0.01, -1))
+                                           - live.begin()))
+            {
+                std::cout << "Window ball results not equal" << std::endl;
+            }
+        }
+    }
+
+    // WHEN: time moves on without new points
+    const double later = points.back().second + window + epochLength;
+
+    // THEN: queries at the later time shouldn't find the expired points, even before they are dropped
+    const std::size_t pointsBeforeExpiry = tree.size();
+    if (tree.searchKnn(randomPoint(), 1, later).size() != 0
+        || tree.searchKnn(randomPoint(), 1, points.back().second).size() != 1)
+    {
+        std::cout << "Window queries found expired points" << std::endl;
+    }
+
+    // AND: all the points should have expired once the window is expired
+    tree.expire(later);
+    if (pointsBeforeExpiry == 0 || tree.size() != 0 || tree.searchKnn(randomPoint(), 1, later).size() != 0)
+    {
+        std::cout << "Window points didn't expire" << std::endl;
+    }
+    std::cout << "Window tests completed" << std::endl;
+}
+
+template <class Tree>
+void layoutBenchmark(const char* name,
+                     const std::vector<std::pair<typename Tree::point_t, typename Tree::payload_t>>& points,
+                     const std::vector<typename Tree::point_t>& searchPoints,
+                     std::vector<std::pair<double, typename Tree::payload_t>>& results)
+{
+    const std::size_t k = 8;
+    Tree tree(points.begin(), points.end());
+
+    // add and remove some points as well, so buckets run out of slots and are moved
+    for (std::size_t i = 0; i < points.size(); i += 7)
+    {
+        tree.addPoint(points[i].first, points[i].second);
+    }
+    for (std::size_t i = 0; i < points.size(); i += 5)
+    {
+        tree.removePoint(points[i].first, points[i].second);
+    }
+
+    std::clock_t start = std::clock();
+    auto searcher = tree.searcher();
+    for (std::size_t i = 0; i < searchPoints.size(); i++)
+    {
+        const auto& nn = searcher.search(searchPoints[i], std::numeric_limits<double>::max(), k);
+        if (results.size() < searchPoints.size() * k)
+        {
+            for (const auto& dp : nn)
+            {
+                results.emplace_back(dp.distance, dp.payload);
+            }
+        }
+        else
+        {
+            for (std::size_t j = 0; j < nn.size(); j++)
+            {
+                if (nn[j].distance != results[i * k + j].first || nn[j].payload != results[i * k + j].second)
+                {
+                    std::cout << name << " layout results not equal" << std::endl;
+                }
+            }
+        }
+    }
+    std::clock_t searched = std::clock();
+
+    std::cout << name << " layout: searching " << double(searched - start) / CLOCKS_PER_SEC << "s" << std::endl;
+}
+
+void layoutTest()
+{
+    std::cout << "Layout tests started" << std::endl;
+
+    // GIVEN: a 3D point cloud with a payload of 32 bytes per point
+    static const int dims = 3;
+    using payload_t = std::array<double, 4>;
+    using point_t = std::array<double, dims>;
+    std::vector<std::pair<point_t, payload_t>> points;
+    for (int i = 0; i < 100000; i++)
+    {
+        points.emplace_back(point_t {{drand(), drand(), drand()}}, payload_t {{double(i), 0, 0, 0}});
+    }
+    std::vector<point_t> searchPoints;
+    for (int i = 0; i < 50000; i++)
+    {
+        searchPoints.push_back(point_t {{drand(), drand(), drand()}});
+    }
+
+    // WHEN: the points are stored with each layout and searched
+    // THEN: the results should be the same
+    using namespace jk::tree;
+    std::vector<std::pair<double, payload_t>> results;
+    layoutBenchmark<KDTree<payload_t, dims, 32, SquaredL2, double, MedianSplit, PointMajorLayout>>(
+        "point major", points, searchPoints, results);
+    layoutBenchmark<KDTree<payload_t, dims, 32, SquaredL2, double, MedianSplit, DimensionMajorLayout>>(
+        "dimension major", points, searchPoints, results);
+
+    std::cout << "Layout tests completed" << std::endl;
+}
+
+template <class Tree>
+void indexTestFill(Tree& tree, const std::vector<std::pair<typename Tree::point_t, int>>& points)
+{
+    // go through splitting on several threads, rebalancing, removal and compacting
+    for (std::size_t i = 0; i < points.size() / 2; i++)
+    {
+        tree.addPoint(points[i].first, points[i].second, false);
+    }
+    tree.splitOutstanding(4);
+    tree.setMaxImbalance(0.6);
+    for (std::size_t i = points.size() / 2; i < points.size(); i++)
+    {
+        tree.addPoint(points[i].first, points[i].second);
+    }
+    for (std::size_t i = 0; i < points.size(); i += 3)
+    {
+        tree.removePoint(points[i].first, points[i].second);
+    }
+    tree.compact();
+}
+
+void indexTest()
+{
+    std::cout << "Index tests started" << std::endl;
+
+    // GIVEN: a tree with the default std::size_t indices and one with 32 bit indices
+    static const int dims = 3;
+    using namespace jk::tree;
+    using tree_t = KDTree<int, dims>;
+    using small_tree_t = KDTree<int, dims, 32, SquaredL2, double, MedianSplit, PointMajorLayout, std::uint32_t>;
+    std::vector<std::pair<tree_t::point_t, int>> points;
+    for (int i = 0; i < 100000; i++)
+    {
+        points.emplace_back(tree_t::point_t {{drand(), drand(), drand()}}, i);
+    }
+
+    // WHEN: the same points are added to and removed from both
+    tree_t tree;
+    small_tree_t smallTree;
+    indexTestFill(tree, points);
+    indexTestFill(smallTree, points);
+
+    // THEN: they should hold the same points and find the same neighbours
+    if (tree.size() != smallTree.size())
+    {
+        std::cout << "Index tree count doesn't match!!!" << std::endl;
+    }
+    auto searcher = tree.searcher();
+    auto smallSearcher = smallTree.searcher();
+    for (int i = 0; i < 10000; i++)
+    {
+        tree_t::point_t loc {{drand(), drand(), drand()}};
+        const auto nn = searcher.search(loc, 0.01, 10);
+        const auto& snn = smallSearcher.search(loc, 0.01, 10);
+        if (nn.size() != snn.size())
+        {
+            std::cout << "Index tree result count doesn't match!!!" << std::endl;
+            continue;
+        }
+        for (std::size_t j = 0; j < nn.size(); j++)
+        {
+            if (nn[j].distance != snn[j].distance || nn[j].payload != snn[j].payload)
+            {
+                std::cout << "Index tree results not equal" << std::endl;
+            }
+        }
+    }
+
+    std::cout << "Index tests completed" << std::endl;
+}
+
+void frozenTest()
+{
+    std::cout << "Frozen tests started" << std::endl;
+
+    // GIVEN: a tree built by adding and removing points one at a time, so its nodes are scattered in memory
+    static const int dims = 3;
+    using tree_t = jk::tree::KDTree<int, dims>;
+    tree_t tree;
+    std::vector<std::pair<tree_t::point_t, int>> points;
+    for (int i = 0; i < 200000; i++)
+    {
+        points.emplace_back(tree_t::point_t {{drand(), drand(), drand()}}, i);
+        tree.addPoint(points.back().first, points.back().second);
+    }
+    for (std::size_t i = 0; i < points.size(); i += 4)
+    {
+        tree.removePoint(points[i].first, points[i].second);
+    }
+    std::vector<tree_t::point_t> searchPoints;
+    for (int i = 0; i < 50000; i++)
+    {
+        searchPoints.push_back(tree_t::point_t {{drand(), drand(), drand()}});
+    }
+
+    // WHEN: it is frozen
+    const auto frozenTree = tree.freeze();
+
+    // THEN: the frozen tree should hold the same points and find the same neighbours
+    if (frozenTree.size() != tree.size())
+    {
+        std::cout << "Frozen tree count doesn't match!!!" << std::endl;
+    }
+    auto searcher = tree.searcher();
+    auto frozenSearcher = frozenTree.searcher();
+    for (std::size_t i = 0; i < searchPoints.size(); i += 10)
+    {
+        const auto& loc = searchPoints[i];
+        const auto nn = searcher.search(loc, 0.002, 10);
+        const auto& fnn = frozenSearcher.search(loc, 0.002, 10);
+        if (nn.size() != fnn.size())
+        {
+            std::cout << "Frozen tree result count doesn't match!!!" << std::endl;
+            continue;
+        }
+        for (std::size_t j = 0; j < nn.size(); j++)
+        {
+            if (nn[j].distance != fnn[j].distance || nn[j].payload != fnn[j].payload)
+            {
+                std::cout << "Frozen tree results not equal" << std::endl;
+            }
+        }
+        if (tree.search(loc).payload != frozenTree.search(loc).payload)
+        {
+            std::cout << "Frozen tree nearest neighbour not equal" << std::endl;
+        }
+    }
+
+    // and it should be faster to search
+    const std::size_t k = 8;
+    std::clock_t start = std::clock();
+    for (const auto& loc : searchPoints)
+    {
+        searcher.search(loc, std::numeric_limits<double>::max(), k);
+    }
+    std::clock_t searched = std::clock();
+    for (const auto& loc : searchPoints)
+    {
+        frozenSearcher.search(loc, std::numeric_limits<double>::max(), k);
+    }
+    std::clock_t frozenSearched = std::clock();
+    std::cout << "dynamic tree: searching " << double(searched - start) / CLOCKS_PER_SEC << "s" << std::endl;
+    std::cout << "frozen tree: searching " << double(frozenSearched - searched) / CLOCKS_PER_SEC << "s" << std::endl;
+
+    std::cout << "Frozen tests completed" << std::endl;
+}
+
+// An allocator that keeps count of the bytes it has outstanding, and can't be default constructed, so that any memory
+// not allocated through the allocator given to the tree would fail to compile
+template <class T>
+struct CountingAllocator
+{
+    using value_type = T;
+
+    explicit CountingAllocator(std::atomic<std::ptrdiff_t>& bytes) : m_bytes(&bytes) { }
+    template <class U>
+    CountingAllocator(const CountingAllocator<U>& other) : m_bytes(other.m_bytes)
+    {
+    }
+
+    T* allocate(std::size_t n)
+    {
+        *m_bytes += n * sizeof(T);
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        *m_bytes -= n * sizeof(T);
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template <class U>
+    bool operator==(const CountingAllocator<U>& other) const
+    {
+        return m_bytes == other.m_bytes;
+    }
+    template <class U>
+    bool operator!=(const CountingAllocator<U>& other) const
+    {
+        return m_bytes != other.m_bytes;
+    }
+
+    std::atomic<std::ptrdiff_t>* m_bytes;
+};
+
+void allocatorTest()
+{
+    std::cout << "Allocator tests started" << std::endl;
+
+    // GIVEN: trees allocating through an allocator that counts its bytes
+    static const int dims = 3;
+    using namespace jk::tree;
+    using allocator_t = CountingAllocator<char>;
+    using tree_t = KDTree<int, dims, 32, SquaredL2, double, MedianSplit, PointMajorLayout, std::size_t, allocator_t>;
+    using forest_t
+        = KDForest<int, dims, 32, SquaredL2, double, MedianSplit, PointMajorLayout, std::size_t, allocator_t>;
+    using window_t
+        = KDWindow<int, dims, 32, SquaredL2, double, MedianSplit, PointMajorLayout, std::size_t, allocator_t>;
+    std::vector<std::pair<tree_t::point_t, int>> points;
+    for (int i = 0; i < 50000; i++)
+    {
+        points.emplace_back(tree_t::point_t {{drand(), drand(), drand()}}, i);
+    }
+    KDTree<int, dims> referenceTree(points.begin(), points.end());
+
+    std::atomic<std::ptrdiff_t> bytes(0);
+    {
+        // WHEN: points are added and removed in all the ways that allocate
+        tree_t tree {allocator_t(bytes)};
+        for (std::size_t i = 0; i < points.size(); i++)
+        {
+            tree.addPoint(points[i].first, points[i].second, i % 2 == 0);
+        }
+        tree.splitOutstanding(4);
+        for (std::size_t i = 0; i < points.size(); i += 10)
+        {
+            tree.removePoint(points[i].first, points[i].second);
+            tree.addPoint(points[i].first, points[i].second);
+        }
+        tree.compact();
+        const auto frozenTree = tree.freeze();
+        tree_t builtTree(points.begin(), points.end(), allocator_t(bytes));
+        forest_t forest(128, allocator_t(bytes));
+        window_t window(1.0, 8, allocator_t(bytes));
+        for (std::size_t i = 0; i < points.size(); i++)
+        {
+            forest.addPoint(points[i].first, points[i].second);
+            window.addPoint(points[i].first, points[i].second, 0.1 * i / points.size());
+        }
+
+        // THEN: the memory of the points should be counted, and the trees should find the same neighbours
+        const std::size_t pointBytes = points.size() * (sizeof(tree_t::point_t) + sizeof(int));
+        if (bytes < std::ptrdiff_t(5 * pointBytes))
+        {
+            std::cout << "Allocator wasn't used for all the points!!!" << std::endl;
+        }
+        for (int i = 0; i < 1000; i++)
+        {
+            tree_t::point_t loc {{drand(), drand(), drand()}};
+            const auto expected = referenceTree.searchKnn(loc, 5);
+            const std::vector<std::vector<tree_t::DistancePayload>> results {tree.searchKnn(loc, 5),
+                                                                             frozenTree.searchKnn(loc, 5),
+                                                                             builtTree.searchKnn(loc, 5),
+                                                                             forest.searchKnn(loc, 5),
+                                                                             window.searchKnn(loc, 5, 0.1)};
+            for (const auto& nn : results)
+            {
+                for (std::size_t j = 0; j < expected.size(); j++)
+                {
+                    if (nn.size() != expected.size() || nn[j].distance != expected[j].distance)
+                    {
+                        std::cout << "Allocator tree results not equal" << std::endl;
+                    }
+                }
+            }
+        }
+    }
+
+    // and everything should be given back when the trees are destroyed
+    if (bytes != 0)
+    {
+        std::cout << "Allocator has " << bytes << " bytes still allocated!!!" << std::endl;
+    }
+
+    std::cout << "Allocator tests completed" << std::endl;
+}
+
+void indirectTest()
+{
+    std::cout << "Indirect tests started" << std::endl;
+
+    // GIVEN: points with 200 byte payloads, in a tree holding the payloads and in one holding their indices
+    static const int dims = 3;
+    using payload_t = std::array<double, 25>;
+    using tree_t = jk::tree::KDTree<payload_t, dims>;
+    using indirect_tree_t = jk::tree::IndirectKDTree<payload_t, dims>;
+    std::vector<std::pair<tree_t::point_t, payload_t>> points;
+    for (int i = 0; i < 100000; i++)
+    {
+        payload_t payload;
+        payload.fill(i);
+        points.emplace_back(tree_t::point_t {{drand(), drand(), drand()}}, payload);
+    }
+    std::vector<tree_t::point_t> searchPoints;
+    for (int i = 0; i < 50000; i++)
+    {
+        searchPoints.push_back(tree_t::point_t {{drand(), drand(), drand()}});
+    }
+
+    // WHEN: the same points are added to and removed from both
+    std::clock_t start = std::clock();
+    tree_t tree;
+    for (const auto& p : points)
+    {
+        tree.addPoint(p.first, p.second);
+    }
+    std::clock_t added = std::clock();
+    indirect_tree_t indirectTree;
+    std::vector<indirect_tree_t::tree_t::payload_t> indices;
+    const payload_t* firstPayload = nullptr;
+    for (const auto& p : points)
+    {
+        indices.push_back(indirectTree.addPoint(p.first, p.second));
+        if (firstPayload == nullptr)
+        {
+            firstPayload = &indirectTree.payload(indices[0]);
+        }
+    }
+    std::clock_t indirectAdded = std::clock();
+    if (firstPayload != &indirectTree.payload(indices[0]))
+    {
+        std::cout << "Indirect tree payload moved while adding!!!" << std::endl;
+    }
+    for (std::size_t i = 0; i < points.size(); i += 3)
+    {
+        tree.removePoint(points[i].first, points[i].second);
+        indirectTree.removePoint(points[i].first, indices[i]);
+    }
+    for (std::size_t i = 0; i < points.size(); i += 6)
+    {
+        // the freed payload indices are reused
+        tree.addPoint(points[i].first, points[i].second);
+        if (indirectTree.addPoint(points[i].first, points[i].second) > points.size())
+        {
+            std::cout << "Indirect tree payload index wasn't reused!!!" << std::endl;
+        }
+    }
+
+    // THEN: they should find the same neighbours, and the indirect tree should be faster
+    if (tree.size() != indirectTree.size())
+    {
+        std::cout << "Indirect tree count doesn't match!!!" << std::endl;
+    }
+    const std::size_t k = 8;
+    std::vector<std::pair<double, payload_t>> results;
+    std::clock_t searchStart = std::clock();
+    auto searcher = tree.searcher();
+    for (const auto& loc : searchPoints)
+    {
+        for (const auto& dp : searcher.search(loc, std::numeric_limits<double>::max(), k))
+        {
+            results.emplace_back(dp.distance, dp.payload);
+        }
+    }
+    std::clock_t searched = std::clock();
+    auto indirectSearcher = indirectTree.searcher();
+    auto result = results.begin();
+    for (const auto& loc : searchPoints)
+    {
+        for (const auto& dp : indirectSearcher.search(loc, std::numeric_limits<double>::max(), k))
+        {
+            if (result == results.end() || dp.distance != result->first
+                || indirectTree.payload(dp.payload) != result->second)
+            {
+                std::cout << "Indirect tree results not equal" << std::endl;
+                break;
+            }
+            ++result;
+        }
+    }
+    std::clock_t indirectSearched = std::clock();
+
+    std::cout << "direct payloads: adding " << double(added - start) / CLOCKS_PER_SEC << "s, searching "
+              << double(searched - searchStart) / CLOCKS_PER_SEC << "s" << std::endl;
+    std::cout << "indirect payloads: adding " << double(indirectAdded - added) / CLOCKS_PER_SEC << "s, searching "
+              << double(indirectSearched - searched) / CLOCKS_PER_SEC << "s" << std::endl;
+
+    std::cout << "Indirect tests completed" << std::endl;
+}
+
+template <class Usage>
+void printMemoryUsage(const char* name, const Usage& usage)
+{
+    std::cout << name << " memory: " << usage.total() << " bytes, nodes " << usage.nodes << "/" << usage.nodesReserved
+              << ", points " << usage.points << "/" << usage.pointsReserved << std::endl;
+}
+
+void memoryTest()
+{
+    std::cout << "Memory tests started" << std::endl;
+
+    // GIVEN: a tree with points added one at a time and some removed
+    static const int dims = 3;
+    using tree_t = jk::tree::KDTree<int, dims>;
+    std::vector<std::pair<tree_t::point_t, int>> points;
+    tree_t tree;
+    for (int i = 0; i < 100000; i++)
+    {
+        points.emplace_back(tree_t::point_t {{drand(), drand(), drand()}}, i);
+        tree.addPoint(points.back().first, points.back().second);
+    }
+    for (std::size_t i = 0; i < points.size(); i += 2)
+    {
+        tree.removePoint(points[i].first, points[i].second);
+    }
+
+    // WHEN: the memory usage is reported
+    const auto usage = tree.memoryUsage();
+
+    // THEN: the points and nodes in use should fit in the memory reserved for them
+    const std::size_t pointBytes = tree.size() * (dims * sizeof(double) + sizeof(int));
+    if (usage.points != pointBytes || usage.pointsReserved < usage.points || usage.nodesReserved < usage.nodes
+        || usage.total() < usage.points + usage.nodes)
+    {
+        std::cout << "Memory usage is wrong!!!" << std::endl;
+    }
+    printMemoryUsage("dynamic tree", usage);
+
+    // WHEN: the tree gives back its spare memory
+    std::vector<std::vector<tree_t::DistancePayload>> before;
+    for (int i = 0; i < 1000; i++)
+    {
+        before.push_back(tree.searchKnn(points[i].first, 5));
+    }
+    tree.shrinkToFit();
+    const auto shrunk = tree.memoryUsage();
+
+    // THEN: the points shouldn't have any spare slots and the searches should find the same points
+    if (shrunk.pointsReserved != shrunk.points || shrunk.nodesReserved > usage.nodesReserved
+        || shrunk.total() >= usage.total())
+    {
+        std::cout << "Memory wasn't given back!!!" << std::endl;
+    }
+    printMemoryUsage("shrunk tree", shrunk);
+    for (int i = 0; i < 1000; i++)
+    {
+        const auto after = tree.searchKnn(points[i].first, 5);
+        for (std::size_t j = 0; j < after.size(); j++)
+        {
+            if (after[j].distance != before[i][j].distance || after[j].payload != before[i][j].payload)
+            {
+                std::cout << "Shrunk tree results not equal" << std::endl;
+            }
+        }
+    }
+
+    // and the tree should still take new points
+    for (std::size_t i = 0; i < points.size(); i += 2)
+    {
+        tree.addPoint(points[i].first, points[i].second);
+    }
+    if (tree.size() != points.size() || tree.memoryUsage().points != 2 * pointBytes)
+    {
+        std::cout << "Shrunk tree count doesn't match!!!" << std::endl;
+    }
+    printMemoryUsage("frozen tree", tree.freeze().memoryUsage());
+
+    std::cout << "Memory tests completed" << std::endl;
+}
+
+template <class Tree>
+void boundsBenchmark(const char* name,
+                     const std::vector<std::pair<typename Tree::point_t, int>>& points,
+                     const std::vector<typename Tree::point_t>& searchPoints,
+                     std::vector<std::pair<double, int>>& results)
+{
+    // add the points one at a time, so bounds are expanded as well as built
+    Tree tree;
+    for (const auto& p : points)
+    {
+        tree.addPoint(p.first, p.second);
+    }
+
+    const std::size_t k = 8;
+    std::size_t result = 0;
+    bool first = results.empty();
+    std::clock_t start = std::clock();
+    auto searcher = tree.searcher();
+    for (const auto& loc : searchPoints)
+    {
+        for (const auto& dp : searcher.search(loc, std::numeric_limits<double>::max(), k))
+        {
+            if (first)
+            {
+                results.emplace_back(dp.distance, dp.payload);
+            }
+            else if (result >= results.size() || dp.distance != results[result].first
+                     || dp.payload != results[result].second)
+            {
+                std::cout << name << " bounds results not equal" << std::endl;
+            }
+            result++;
+        }
+    }
+    std::clock_t searched = std::clock();
+
+    std::cout << name << " bounds: searching " << double(searched - start) / CLOCKS_PER_SEC << "s, "
+              << tree.memoryUsage().nodes << " bytes of nodes" << std::endl;
+}
+
+void boundsTest()
+{
+    std::cout << "Bounds tests started" << std::endl;
+
+    // GIVEN: 6D points far from the origin, where float can't represent the coordinates exactly
+    static const int dims = 6;
+    using point_t = std::array<double, dims>;
+    auto randomPoint = []() {
+        point_t point;
+        for (auto& coordinate : point)
+        {
+            coordinate = 1000 + 0.01 * drand();
+        }
+        return point;
+    };
+    std::vector<std::pair<point_t, int>> points;
+    for (int i = 0; i < 100000; i++)
+    {
+        points.emplace_back(randomPoint(), i);
+    }
+    std::vector<point_t> searchPoints;
+    for (int i = 0; i < 20000; i++)
+    {
+        searchPoints.push_back(randomPoint());
+    }
+
+    // WHEN: the nodes store their bounds as double or as float
+    // THEN: the results should be the same
+    using namespace jk::tree;
+    using allocator_t = std::allocator<char>;
+    std::vector<std::pair<double, int>> results;
+    boundsBenchmark<KDTree<int, dims, 32, SquaredL2, double, MedianSplit, PointMajorLayout, std::size_t, allocator_t>>(
+        "double", points, searchPoints, results);
+    boundsBenchmark<
+        KDTree<int, dims, 32, SquaredL2, double, MedianSplit, PointMajorLayout, std::size_t, allocator_t, float>>(
+        "float", points, searchPoints, results);
+
+    std::cout << "Bounds tests completed" << std::endl;
+}
+
+void noPayloadTest()
+{
+    std::cout << "No payload tests started" << std::endl;
+
+    // GIVEN: points in a tree without payloads, and in a tree with their indices as payloads
+    static const int dims = 3;
+    using tree_t = jk::tree::KDTree<void, dims>;
+    using int_tree_t = jk::tree::KDTree<int, dims>;
+    std::vector<tree_t::point_t> locations;
+    std::vector<std::pair<tree_t::point_t, int>> points;
+    for (int i = 0; i < 10000; i++)
+    {
+        locations.push_back(tree_t::point_t {{drand(), drand(), drand()}});
+        points.emplace_back(locations.back(), i);
+    }
+
+    tree_t built(locations.begin(), locations.begin() + 5000);
+    int_tree_t intTree(points.begin(), points.end());
+
+    // WHEN: the rest of the points are added one at a time and as a batch, and some of them are removed
+    tree_t added;
+    for (std::size_t i = 0; i < 7500; i++)
+    {
+        if (added.addPoint(locations[i]) != i)
+        {
+            std::cout << "No payload index of added point is wrong" << std::endl;
+        }
+    }
+    added.addPoints(locations.begin() + 7500, locations.end());
+    built.addPoints(locations.begin() + 5000, locations.end());
+    for (std::size_t i = 0; i < locations.size(); i += 10)
+    {
+        if (!added.removePoint(locations[i], i) || !built.removePoint(locations[i], i)
+            || !intTree.removePoint(locations[i], int(i)))
+        {
+            std::cout << "No payload point not removed" << std::endl;
+        }
+    }
+    if (added.addPoint(locations[0]) != locations.size())
+    {
+        std::cout << "No payload index after removal is wrong" << std::endl;
+    }
+    added.removePoint(locations[0], locations.size());
+
+    // THEN: the points are found with their indices, like the payloads of the tree with payloads
+    auto frozen = built.freeze();
+    for (int i = 0; i < 1000; i++)
+    {
+        tree_t::point_t location {{drand(), drand(), drand()}};
+        auto expected = intTree.searchKnn(location, 10);
+        for (const auto& results : {added.searchKnn(location, 10), built.searchKnn(location, 10),
+                                    frozen.searchKnn(location, 10)})
+        {
+            bool same = results.size() == expected.size();
+            for (std::size_t j = 0; same && j < results.size(); j++)
+            {
+                same = results[j].payload == std::size_t(expected[j].payload)
+                    && results[j].distance == expected[j].distance;
+            }
+            if (!same)
+            {
+                std::cout << "No payload results not equal" << std::endl;
+            }
+        }
+    }
+
+    std::cout << "No payload tests completed" << std::endl;
+}
+
+template <class Tree>
+Tree chunkedBenchmark(const char* name, const std::vector<std::pair<typename Tree::point_t, int>>& points)
+{
+    Tree tree;
+    double slowest = 0;
+    std::clock_t start = std::clock();
+    for (const auto& p : points)
+    {
+        std::clock_t before = std::clock();
+        tree.addPoint(p.first, p.second);
+        slowest = std::max(slowest, double(std::clock() - before) / CLOCKS_PER_SEC);
+    }
+    std::cout << name << " nodes: adding " << double(std::clock() - start) / CLOCKS_PER_SEC << "s, slowest addPoint "
+              << slowest << "s" << std::endl;
+    return tree;
+}
+
+void chunkedTest()
+{
+    std::cout << "Chunked tests started" << std::endl;
+
+    // GIVEN: points added one at a time to a tree with its nodes in one vector, and to one with them in small chunks
+    static const int dims = 3;
+    using tree_t = jk::tree::KDTree<int, dims>;
+    using chunked_tree_t = jk::tree::KDTree<int,
+                                            dims,
+                                            32,
+                                            jk::tree::SquaredL2,
+                                            double,
+                                            jk::tree::MedianSplit,
+                                            jk::tree::PointMajorLayout,
+                                            std::size_t,
+                                            std::allocator<char>,
+                                            double,
+                                            jk::tree::ChunkedNodes<64>>;
+    std::vector<std::pair<tree_t::point_t, int>> points;
+    for (int i = 0; i < 500000; i++)
+    {
+        points.emplace_back(tree_t::point_t {{drand(), drand(), drand()}}, i);
+    }
+    tree_t tree = chunkedBenchmark<tree_t>("contiguous", points);
+    chunked_tree_t chunked = chunkedBenchmark<chunked_tree_t>("chunked", points);
+
+    // WHEN: points are removed and the trees are compacted, copied, split in parallel and frozen
+    for (std::size_t i = 0; i < points.size(); i += 3)
+    {
+        tree.removePoint(points[i].first, points[i].second);
+        chunked.removePoint(points[i].first, points[i].second);
+    }
+    tree.compact();
+    chunked.compact();
+    chunked_tree_t copy = chunked;
+    chunked_tree_t split;
+    for (const auto& p : points)
+    {
+        split.addPoint(p.first, p.second, false);
+    }
+    split.splitOutstanding(4);
+    auto frozen = copy.freeze();
+
+    // THEN: they find the same points as the trees with contiguous nodes
+    tree_t all(points.begin(), points.end());
+    for (int i = 0; i < 1000; i++)
+    {
+        tree_t::point_t location {{drand(), drand(), drand()}};
+        auto expected = tree.searchKnn(location, 10);
+        for (const auto& results : {chunked.searchKnn(location, 10), copy.searchKnn(location, 10),
+                                    frozen.searchKnn(location, 10)})
+        {
+            bool same = results.size() == expected.size();
+            for (std::size_t j = 0; same && j < results.size(); j++)
+            {
+                same = results[j].payload == expected[j].payload && results[j].distance == expected[j].distance;
+            }
+            if (!same)
+            {
+                std::cout << "Chunked results not equal" << std::endl;
+            }
+        }
+        auto expectedAll = all.searchKnn(location, 10);
+        auto splitResults = split.searchKnn(location, 10);
+        for (std::size_t j = 0; j < splitResults.size(); j++)
+        {
+            if (splitResults.size() != expectedAll.size() || splitResults[j].payload != expectedAll[j].payload)
+            {
+                std::cout << "Chunked parallel split results not equal" << std::endl;
+            }
+        }
+    }
+
+    std::cout << "Chunked tests completed" << std::endl;
+}
+
+void splitMemoryTest()
+{
+    std::cout << "Split memory tests started" << std::endl;
+
+    // GIVEN: points which pile up in the root bucket because they are added without splitting
+    static const int dims = 3;
+    using tree_t = jk::tree::KDTree<int, dims>;
+    std::vector<std::pair<tree_t::point_t, int>> points;
+    for (int i = 0; i < 200000; i++)
+    {
+        points.emplace_back(tree_t::point_t {{drand(), drand(), drand()}}, i);
+    }
+    tree_t serial;
+    tree_t parallel;
+    for (const auto& p : points)
+    {
+        serial.addPoint(p.first, p.second, false);
+        parallel.addPoint(p.first, p.second, false);
+    }
+    const tree_t::MemoryUsage unsplit = serial.memoryUsage();
+
+    // WHEN: the buckets are split
+    serial.splitOutstanding();
+    parallel.splitOutstanding(4);
+
+    // THEN: the free slots of the root bucket aren't kept, so the points take about as much memory as in a built tree
+    const tree_t built(points.begin(), points.end());
+    for (const tree_t* tree : {&serial, &parallel})
+    {
+        const tree_t::MemoryUsage usage = tree->memoryUsage();
+        std::cout << "points reserved before splitting " << unsplit.pointsReserved << ", after "
+                  << usage.pointsReserved << ", when built " << built.memoryUsage().pointsReserved << std::endl;
+        if (usage.pointsReserved > 2 * built.memoryUsage().pointsReserved)
+        {
+            std::cout << "Split memory too large" << std::endl;
+        }
+    }
+    for (int i = 0; i < 1000; i++)
+    {
+        tree_t::point_t location {{drand(), drand(), drand()}};
+        auto expected = built.searchKnn(location, 10);
+        for (const auto& results : {serial.searchKnn(location, 10), parallel.searchKnn(location, 10)})
+        {
+            bool same = results.size() == expected.size();
+            for (std::size_t j = 0; same && j < results.size(); j++)
+            {
+                same = results[j].payload == expected[j].payload;
+            }
+            if (!same)
+            {
+                std::cout << "Split memory results not equal" << std::endl;
+            }
+        }
+    }
+
+    // WHEN: the points are added one at a time, splitting buckets as they fill up
+    tree_t autosplit;
+    for (const auto& p : points)
+    {
+        autosplit.addPoint(p.first, p.second);
+    }
+
+    // THEN: the buckets keep few free slots, so the points take at most a few times as much memory as in a built tree,
+    // which keeps none
+    const tree_t::MemoryUsage builtUsage = built.memoryUsage();
+    const tree_t::MemoryUsage autosplitUsage = autosplit.memoryUsage();
+    std::cout << "points reserved when split while adding " << autosplitUsage.pointsReserved << std::endl;
+    if (builtUsage.pointsReserved != builtUsage.points || autosplitUsage.pointsReserved > 3 * builtUsage.points)
+    {
+        std::cout << "Split memory too large" << std::endl;
+    }
+
+    std::cout << "Split memory tests completed" << std::endl;
+}
+
+// SquaredL2 without coordinateDistance(), so buckets are scanned a point at a time
+struct PointwiseSquaredL2
+{
+    template <std::size_t Dimensions, typename Scalar>
+    static Scalar distance(const std::array<Scalar, Dimensions>& location1,
+                           const std::array<Scalar, Dimensions>& location2)
+    {
+        return jk::tree::SquaredL2::distance(location1, location2);
+    }
+};
+
+template <class Tree>
+void scanTestCompare(const char* name)
+{
+    // GIVEN: a tree with large buckets, so they are scanned in several blocks, and the same points in a list
+    using scalar_t = typename Tree::scalar_t;
+    using point_t = typename Tree::point_t;
+    using distance_t = typename Tree::distance_t;
+    std::vector<std::pair<point_t, int>> points;
+    for (int i = 0; i < 20000; i++)
+    {
+        point_t point;
+        for (auto& coordinate : point)
+        {
+            coordinate = scalar_t(drand());
+        }
+        points.emplace_back(point, i);
+    }
+    const Tree tree(points.begin(), points.end());
+
+    // WHEN: searching the tree and the list
+    // THEN: the same points are found with exactly the same distances
+    for (int i = 0; i < 200; i++)
+    {
+        point_t location;
+        for (auto& coordinate : location)
+        {
+            coordinate = scalar_t(drand());
+        }
+        std::vector<std::pair<scalar_t, int>> expected;
+        for (const auto& p : points)
+        {
+            expected.emplace_back(distance_t::distance(location, p.first), p.second);
+        }
+        std::sort(expected.begin(), expected.end());
+        const std::size_t k = 20;
+        const scalar_t radius = expected[k].first;
+        auto knn = tree.searchKnn(location, k);
+        auto ball = tree.searchBall(location, radius);
+        auto nearest = tree.search(location);
+        bool same = knn.size() == k && ball.size() == k && nearest.distance == expected[0].first;
+        for (std::size_t j = 0; same && j < k; j++)
+        {
+            same = knn[j].distance == expected[j].first && ball[j].distance == expected[j].first;
+        }
+        if (!same)
+        {
+            std::cout << name << " scan results not equal" << std::endl;
+        }
+    }
+}
+
+void scanTest()
+{
+    std::cout << "Scan tests started" << std::endl;
+
+    using namespace jk::tree;
+    using allocator_t = std::allocator<char>;
+    scanTestCompare<KDTree<int, 3, 100, SquaredL2, double, MedianSplit, PointMajorLayout>>("point major double");
+    scanTestCompare<KDTree<int, 3, 100, SquaredL2, double, MedianSplit, DimensionMajorLayout>>(
+        "dimension major double");
+    scanTestCompare<KDTree<int, 5, 100, SquaredL2, float, MedianSplit, PointMajorLayout>>("point major float");
+    scanTestCompare<KDTree<int, 5, 100, SquaredL2, float, MedianSplit, DimensionMajorLayout>>("dimension major float");
+    scanTestCompare<KDTree<int, 4, 100, L1, float, MedianSplit, DimensionMajorLayout>>("dimension major L1");
+    scanTestCompare<KDTree<int, 4, 100, PointwiseSquaredL2, double, MedianSplit, DimensionMajorLayout>>("pointwise");
+    // enough dimensions for monotonic distances to stop summing points which are too far
+    scanTestCompare<KDTree<int, 32, 100, SquaredL2, float, MedianSplit, PointMajorLayout>>("point major 32d");
+    scanTestCompare<KDTree<int, 32, 100, SquaredL2, float, MedianSplit, DimensionMajorLayout>>("dimension major 32d");
+    scanTestCompare<KDTree<int, 20, 100, L1, double, MedianSplit, DimensionMajorLayout>>("dimension major L1 20d");
+    scanTestCompare<
+        KDTree<int, 3, 100, SquaredL2, double, MedianSplit, PointMajorLayout, std::size_t, allocator_t, float>>(
+        "float bounds");
+    scanTestCompare<
+        KDTree<int, 16, 100, SquaredL2, double, MedianSplit, PointMajorLayout, std::size_t, allocator_t, float>>(
+        "float bounds 16d");
+
+    std::cout << "Scan tests completed" << std::endl;
+}
+
 #define DURATION double(((previous = current) * 0 + (current = std::clock()) - previous) / double(CLOCKS_PER_SEC))
 void performanceTest()
 {